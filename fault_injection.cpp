@@ -41,6 +41,7 @@ namespace
 
     thread_local bool disabled = false;
     thread_local fault_injection_context* context = nullptr;
+    thread_local size_t allocations = 0;
 
     void dump_state()
     {
@@ -127,6 +128,11 @@ void faulty_run(std::function<void ()> const& f)
 #endif
 }
 
+size_t allocations_on_this_thread()
+{
+    return allocations;
+}
+
 fault_injection_disable::fault_injection_disable()
     : was_disabled(disabled)
 {
@@ -147,6 +153,7 @@ void* operator new(std::size_t count)
     if (!ptr)
         throw std::bad_alloc();
 
+    ++allocations;
     return ptr;
 }
 
@@ -159,6 +166,7 @@ void* operator new[](std::size_t count)
     if (!ptr)
         throw std::bad_alloc();
 
+    ++allocations;
     return ptr;
 }
 
@@ -11,6 +11,7 @@ struct injected_fault : std::runtime_error
 bool should_inject_fault();
 void fault_injection_point();
 void faulty_run(std::function<void ()> const& f);
+size_t allocations_on_this_thread();
 
 struct fault_injection_disable
 {
@@ -0,0 +1,578 @@
+#ifndef VECTOR_PERSISTENT_VECTOR_H
+#define VECTOR_PERSISTENT_VECTOR_H
+
+#include "vector.h"
+
+// A vector stored as a 32-way trie of fixed-size chunks. Every node has its own owner count,
+// so copies share the whole tree and a write to a shared copy clones only the nodes on the
+// path to the element: O(log n) nodes and at most one chunk of elements, instead of the
+// whole buffer. Elements are not contiguous, hence there is no data().
+template<typename T, typename Counter = plain_counter>
+class persistent_vector {
+    // Nodes are shared in noexcept code, so their counters must never be full.
+    static_assert(sizeof(typename Counter::count_type) >= sizeof(size_t),
+                  "persistent_vector needs a size_t counter");
+
+    static constexpr size_t bits = 5;
+
+    static constexpr size_t branching = size_t(1) << bits;
+
+    static constexpr size_t mask = branching - 1;
+
+    // size_ counts children in a branch and elements in a leaf.
+    struct node {
+        Counter number_of_masters_;
+        size_t size_;
+
+        node() noexcept : number_of_masters_(1), size_(0) {}
+    };
+
+    struct branch : node {
+        node *children_[branching];
+    };
+
+    struct leaf : node {
+        alignas(T) unsigned char items_[branching * sizeof(T)];
+
+        T *items() noexcept {
+            return std::launder(reinterpret_cast<T *>(items_));
+        }
+
+        T const *items() const noexcept {
+            return std::launder(reinterpret_cast<T const *>(items_));
+        }
+    };
+
+    // Nodes at shift 0 are leaves; shift_ is the shift of the root.
+    node *root_;
+    size_t shift_;
+    size_t size_;
+
+    static void release(node *n, size_t shift) noexcept {
+        if (!n || !n->number_of_masters_.release()) {
+            return;
+        }
+        if (shift == 0) {
+            auto *l = static_cast<leaf *>(n);
+            std::destroy(l->items(), l->items() + l->size_);
+            delete l;
+        } else {
+            auto *b = static_cast<branch *>(n);
+            for (size_t i = 0; i != b->size_; ++i) {
+                release(b->children_[i], shift - bits);
+            }
+            delete b;
+        }
+    }
+
+    static node *create(size_t shift) {
+        if (shift == 0) {
+            return new leaf;
+        }
+        return new branch;
+    }
+
+    // Private copy of a shared node with its first `count` elements or children.
+    static node *clone(node const *n, size_t shift, size_t count) {
+        if (shift == 0) {
+            auto const *l = static_cast<leaf const *>(n);
+            auto *result = new leaf;
+            try {
+                std::uninitialized_copy(l->items(), l->items() + count, result->items());
+            } catch (...) {
+                delete result;
+                throw;
+            }
+            result->size_ = count;
+            return result;
+        }
+        auto const *b = static_cast<branch const *>(n);
+        auto *result = new branch;
+        for (size_t i = 0; i != count; ++i) {
+            result->children_[i] = b->children_[i];
+            result->children_[i]->number_of_masters_.acquire();
+        }
+        result->size_ = count;
+        return result;
+    }
+
+    // Replaces a shared node in its slot by a private copy of its first `count` entries.
+    static void unshare(node *&slot, size_t shift, size_t count) {
+        if (slot->number_of_masters_.unique()) {
+            return;
+        }
+        node *copy = clone(slot, shift, count);
+        release(slot, shift);
+        slot = copy;
+    }
+
+    // Makes every node on the way to index private, creating the missing ones, and returns
+    // the leaf. On failure the tree still holds the same elements.
+    leaf *unshare_path(size_t index) {
+        node **slot = &root_;
+        for (size_t shift = shift_;; shift -= bits) {
+            unshare(*slot, shift, (*slot)->size_);
+            if (shift == 0) {
+                return static_cast<leaf *>(*slot);
+            }
+            auto *b = static_cast<branch *>(*slot);
+            size_t child = (index >> shift) & mask;
+            if (child == b->size_) {
+                b->children_[child] = create(shift - bits);
+                ++b->size_;
+            }
+            slot = &b->children_[child];
+        }
+    }
+
+    leaf const *leaf_for(size_t index) const noexcept {
+        node const *n = root_;
+        for (size_t shift = shift_; shift != 0; shift -= bits) {
+            n = static_cast<branch const *>(n)->children_[(index >> shift) & mask];
+        }
+        return static_cast<leaf const *>(n);
+    }
+
+    size_t capacity() const noexcept {
+        return root_ ? branching << shift_ : 0;
+    }
+
+    // Adds a level when the tree is full, so that index size_ has a slot.
+    void make_room() {
+        if (!root_) {
+            root_ = create(0);
+            shift_ = 0;
+        } else if (size_ == capacity()) {
+            auto *b = new branch;
+            b->children_[0] = root_;
+            b->size_ = 1;
+            root_ = b;
+            shift_ += bits;
+        }
+    }
+
+    // Removes the last element below slot. Empty nodes are dropped, and a shared leaf is
+    // replaced by a copy of its survivors only.
+    static void pop_path(node *&slot, size_t shift) {
+        if (shift == 0) {
+            if (slot->number_of_masters_.unique()) {
+                auto *l = static_cast<leaf *>(slot);
+                l->items()[--l->size_].~T();
+            } else {
+                unshare(slot, 0, slot->size_ - 1);
+            }
+        } else {
+            unshare(slot, shift, slot->size_);
+            auto *b = static_cast<branch *>(slot);
+            pop_path(b->children_[b->size_ - 1], shift - bits);
+            if (b->children_[b->size_ - 1]->size_ == 0) {
+                release(b->children_[--b->size_], shift - bits);
+            }
+        }
+    }
+
+    // Returns whether n is left empty after dropping its empty trailing children.
+    static bool trim_path(node *n, size_t shift) noexcept {
+        if (shift == 0) {
+            return n->size_ == 0;
+        }
+        auto *b = static_cast<branch *>(n);
+        while (b->size_ != 0 && trim_path(b->children_[b->size_ - 1], shift - bits)) {
+            release(b->children_[--b->size_], shift - bits);
+        }
+        return b->size_ == 0;
+    }
+
+    // Drops levels that have a single child left.
+    void collapse_root() noexcept {
+        while (shift_ != 0 && root_->size_ == 1) {
+            node *child = static_cast<branch *>(root_)->children_[0];
+            child->number_of_masters_.acquire();
+            release(root_, shift_);
+            root_ = child;
+            shift_ -= bits;
+        }
+    }
+
+    // Removes the empty nodes a failed emplace_back may have attached. Only freshly made or
+    // unshared nodes can be empty, so this never touches a shared subtree.
+    void trim() noexcept {
+        if (root_ && trim_path(root_, shift_)) {
+            release(root_, shift_);
+            root_ = nullptr;
+            shift_ = 0;
+            return;
+        }
+        if (root_) {
+            collapse_root();
+        }
+    }
+
+    template<typename Ref, typename Ptr>
+    class basic_iterator {
+        friend class persistent_vector;
+
+        template<typename, typename>
+        friend class basic_iterator;
+
+        typedef std::conditional_t<std::is_const_v<std::remove_reference_t<Ref>>,
+                persistent_vector const, persistent_vector> owner_type;
+
+        static constexpr bool is_const = std::is_const_v<owner_type>;
+
+        owner_type *owner_;
+        size_t index_;
+        // const_iterator remembers the chunk it read last, so a scan walks the trie once per
+        // chunk. Like every iterator here it is invalidated by writes to the vector.
+        mutable T const *chunk_;
+        mutable size_t chunk_first_;
+
+        basic_iterator(owner_type *owner, size_t index) noexcept
+                : owner_(owner), index_(index), chunk_(nullptr), chunk_first_(0) {}
+
+        Ref get(size_t index) const {
+            if constexpr (is_const) {
+                if (!chunk_ || index - chunk_first_ >= branching) {
+                    chunk_ = owner_->leaf_for(index)->items();
+                    chunk_first_ = index & ~mask;
+                }
+                return chunk_[index & mask];
+            } else {
+                return (*owner_)[index];
+            }
+        }
+
+    public:
+        typedef std::random_access_iterator_tag iterator_category;
+
+        typedef T value_type;
+
+        typedef std::ptrdiff_t difference_type;
+
+        typedef Ptr pointer;
+
+        typedef Ref reference;
+
+        basic_iterator() noexcept : basic_iterator(nullptr, 0) {}
+
+        // iterator converts to const_iterator.
+        template<typename R, typename P, typename = std::enable_if_t<std::is_convertible_v<P, Ptr>>>
+        basic_iterator(basic_iterator<R, P> const &other) noexcept : basic_iterator(other.owner_, other.index_) {}
+
+        reference operator*() const {
+            return get(index_);
+        }
+
+        pointer operator->() const {
+            return &get(index_);
+        }
+
+        reference operator[](difference_type n) const {
+            return get(index_ + n);
+        }
+
+        basic_iterator &operator++() noexcept {
+            ++index_;
+            return *this;
+        }
+
+        basic_iterator operator++(int) noexcept {
+            basic_iterator result = *this;
+            ++index_;
+            return result;
+        }
+
+        basic_iterator &operator--() noexcept {
+            --index_;
+            return *this;
+        }
+
+        basic_iterator operator--(int) noexcept {
+            basic_iterator result = *this;
+            --index_;
+            return result;
+        }
+
+        basic_iterator &operator+=(difference_type n) noexcept {
+            index_ += n;
+            return *this;
+        }
+
+        basic_iterator &operator-=(difference_type n) noexcept {
+            index_ -= n;
+            return *this;
+        }
+
+        friend basic_iterator operator+(basic_iterator it, difference_type n) noexcept {
+            return it += n;
+        }
+
+        friend basic_iterator operator+(difference_type n, basic_iterator it) noexcept {
+            return it += n;
+        }
+
+        friend basic_iterator operator-(basic_iterator it, difference_type n) noexcept {
+            return it -= n;
+        }
+
+        friend difference_type operator-(basic_iterator const &lhs, basic_iterator const &rhs) noexcept {
+            return static_cast<difference_type>(lhs.index_) - static_cast<difference_type>(rhs.index_);
+        }
+
+        friend bool operator==(basic_iterator const &lhs, basic_iterator const &rhs) noexcept {
+            return lhs.index_ == rhs.index_;
+        }
+
+        friend bool operator!=(basic_iterator const &lhs, basic_iterator const &rhs) noexcept {
+            return lhs.index_ != rhs.index_;
+        }
+
+        friend bool operator<(basic_iterator const &lhs, basic_iterator const &rhs) noexcept {
+            return lhs.index_ < rhs.index_;
+        }
+
+        friend bool operator>(basic_iterator const &lhs, basic_iterator const &rhs) noexcept {
+            return lhs.index_ > rhs.index_;
+        }
+
+        friend bool operator<=(basic_iterator const &lhs, basic_iterator const &rhs) noexcept {
+            return lhs.index_ <= rhs.index_;
+        }
+
+        friend bool operator>=(basic_iterator const &lhs, basic_iterator const &rhs) noexcept {
+            return lhs.index_ >= rhs.index_;
+        }
+    };
+
+public:
+    typedef T value_type;
+
+    // Dereferencing an iterator unshares the path to its element, like operator[].
+    typedef basic_iterator<T &, T *> iterator;
+
+    typedef basic_iterator<T const &, T const *> const_iterator;
+
+    typedef std::reverse_iterator<iterator> reverse_iterator;
+
+    typedef std::reverse_iterator<const_iterator> const_reverse_iterator;
+
+    typedef T &reference;
+
+    typedef T const &const_reference;
+
+    typedef T *pointer;
+
+    typedef T const *const_pointer;
+
+    persistent_vector() noexcept : root_(nullptr), shift_(0), size_(0) {}
+
+    persistent_vector(persistent_vector const &rhs) noexcept
+            : root_(rhs.root_), shift_(rhs.shift_), size_(rhs.size_) {
+        if (root_) {
+            root_->number_of_masters_.acquire();
+        }
+    }
+
+    persistent_vector(persistent_vector &&rhs) noexcept : root_(rhs.root_), shift_(rhs.shift_), size_(rhs.size_) {
+        rhs.root_ = nullptr;
+        rhs.shift_ = 0;
+        rhs.size_ = 0;
+    }
+
+    template<typename InputIterator, typename = iterator_category_t<InputIterator>>
+    persistent_vector(InputIterator first, InputIterator last) : persistent_vector() {
+        for (; first != last; ++first) {
+            push_back(*first);
+        }
+    }
+
+    persistent_vector(size_t count, const_reference item) : persistent_vector() {
+        for (size_t i = 0; i != count; ++i) {
+            push_back(item);
+        }
+    }
+
+    persistent_vector &operator=(persistent_vector const &rhs) noexcept {
+        persistent_vector tmp(rhs);
+        swap(*this, tmp);
+        return *this;
+    }
+
+    persistent_vector &operator=(persistent_vector &&rhs) noexcept {
+        persistent_vector tmp(std::move(rhs));
+        swap(*this, tmp);
+        return *this;
+    }
+
+    template<typename InputIterator, typename = iterator_category_t<InputIterator>>
+    void assign(InputIterator first, InputIterator last) {
+        *this = persistent_vector(first, last);
+    }
+
+    persistent_vector const &cview() const noexcept {
+        return *this;
+    }
+
+    iterator begin() noexcept {
+        return iterator(this, 0);
+    }
+
+    iterator end() noexcept {
+        return iterator(this, size_);
+    }
+
+    const_iterator begin() const noexcept {
+        return const_iterator(this, 0);
+    }
+
+    const_iterator end() const noexcept {
+        return const_iterator(this, size_);
+    }
+
+    const_iterator cbegin() const noexcept {
+        return const_iterator(this, 0);
+    }
+
+    const_iterator cend() const noexcept {
+        return const_iterator(this, size_);
+    }
+
+    reverse_iterator rbegin() noexcept {
+        return std::make_reverse_iterator(end());
+    }
+
+    reverse_iterator rend() noexcept {
+        return std::make_reverse_iterator(begin());
+    }
+
+    const_reverse_iterator rbegin() const noexcept {
+        return std::make_reverse_iterator(cend());
+    }
+
+    const_reverse_iterator rend() const noexcept {
+        return std::make_reverse_iterator(cbegin());
+    }
+
+    const_reverse_iterator crbegin() const noexcept {
+        return std::make_reverse_iterator(cend());
+    }
+
+    const_reverse_iterator crend() const noexcept {
+        return std::make_reverse_iterator(cbegin());
+    }
+
+    reference operator[](size_t i) {
+        return unshare_path(i)->items()[i & mask];
+    }
+
+    const_reference operator[](size_t i) const noexcept {
+        return leaf_for(i)->items()[i & mask];
+    }
+
+    reference front() {
+        return (*this)[0];
+    }
+
+    const_reference front() const noexcept {
+        return (*this)[0];
+    }
+
+    reference back() {
+        return (*this)[size_ - 1];
+    }
+
+    const_reference back() const noexcept {
+        return (*this)[size_ - 1];
+    }
+
+    bool empty() const noexcept {
+        return size_ == 0;
+    }
+
+    size_t size() const noexcept {
+        return size_;
+    }
+
+    void clear() noexcept {
+        release(root_, shift_);
+        root_ = nullptr;
+        shift_ = 0;
+        size_ = 0;
+    }
+
+    template<typename... Args>
+    reference emplace_back(Args &&... args) {
+        leaf *l;
+        try {
+            make_room();
+            l = unshare_path(size_);
+            new(l->items() + l->size_) T(std::forward<Args>(args)...);
+        } catch (...) {
+            trim();
+            throw;
+        }
+        ++l->size_;
+        ++size_;
+        return l->items()[l->size_ - 1];
+    }
+
+    void push_back(const_reference item) {
+        emplace_back(item);
+    }
+
+    void push_back(value_type &&item) {
+        emplace_back(std::move(item));
+    }
+
+    void pop_back() {
+        if (size_ == 1) {
+            clear();
+            return;
+        }
+        pop_path(root_, shift_);
+        --size_;
+        collapse_root();
+    }
+
+    friend bool operator==(persistent_vector const &lhs, persistent_vector const &rhs) {
+        if (lhs.root_ == rhs.root_) {
+            return true;
+        }
+        return std::equal(lhs.cbegin(), lhs.cend(), rhs.cbegin(), rhs.cend());
+    }
+
+    friend bool operator!=(persistent_vector const &lhs, persistent_vector const &rhs) {
+        return !(lhs == rhs);
+    }
+
+    friend bool operator<(persistent_vector const &lhs, persistent_vector const &rhs) {
+        if (lhs.root_ == rhs.root_) {
+            return false;
+        }
+        return std::lexicographical_compare(lhs.cbegin(), lhs.cend(), rhs.cbegin(), rhs.cend());
+    }
+
+    friend bool operator>(persistent_vector const &lhs, persistent_vector const &rhs) {
+        return rhs < lhs;
+    }
+
+    friend bool operator<=(persistent_vector const &lhs, persistent_vector const &rhs) {
+        return !(lhs > rhs);
+    }
+
+    friend bool operator>=(persistent_vector const &lhs, persistent_vector const &rhs) {
+        return !(lhs < rhs);
+    }
+
+    friend void swap(persistent_vector &lhs, persistent_vector &rhs) noexcept {
+        std::swap(lhs.root_, rhs.root_);
+        std::swap(lhs.shift_, rhs.shift_);
+        std::swap(lhs.size_, rhs.size_);
+    }
+
+    ~persistent_vector() {
+        release(root_, shift_);
+    }
+};
+
+#endif //VECTOR_PERSISTENT_VECTOR_H
@@ -5,41 +5,1761 @@
 #ifndef VECTOR_VECTOR_H
 #define VECTOR_VECTOR_H
 
+#include <cstdint>
 #include <cstdio>
-#include <variant>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <limits>
+#include <stdexcept>
 #include <memory>
+#include <memory_resource>
+#include <atomic>
+#include <algorithm>
+#include <iterator>
+#include <type_traits>
+#include <utility>
+
+#include "vector_parallel.h"
+#include "vector_simd.h"
+
+// Lets the optimizer rely on cond; does nothing on compilers that cannot be told.
+inline void vector_assume(bool cond) noexcept {
+#if defined(__GNUC__)
+    if (!cond) {
+        __builtin_unreachable();
+    }
+#else
+    (void) cond;
+#endif
+}
+
+#if defined(__GNUC__)
+#define VECTOR_NOINLINE __attribute__((noinline))
+#elif defined(_MSC_VER)
+#define VECTOR_NOINLINE __declspec(noinline)
+#else
+#define VECTOR_NOINLINE
+#endif
+
+// Count is also the width of the block header's size and capacity, so a 32-bit counter
+// gives a compact header. acquire() fails rather than wrap when a narrow count is full; a
+// size_t count cannot fill up, as there is no memory for that many owners.
+template<typename Count>
+class basic_plain_counter {
+    Count count_;
 
+public:
+    typedef Count count_type;
+
+    explicit basic_plain_counter(size_t count) noexcept : count_(count) {}
+
+    bool unique() const noexcept {
+        return count_ == 1;
+    }
+
+    bool acquire() noexcept {
+        // Only an owner shares its block, so the count is at least 1 here and the block stays
+        // shared afterwards. Saying so lets the optimizer see that a block just copied from is
+        // neither realloc'd nor freed by the copy's next write.
+        vector_assume(count_ != 0);
+        if constexpr (sizeof(Count) < sizeof(size_t)) {
+            if (count_ == std::numeric_limits<Count>::max()) {
+                return false;
+            }
+        }
+        ++count_;
+        return true;
+    }
+
+    bool release() noexcept {
+        return --count_ == 0;
+    }
+};
+
+template<typename Count>
+class basic_atomic_counter {
+    std::atomic<Count> count_;
+
+public:
+    typedef Count count_type;
+
+    explicit basic_atomic_counter(size_t count) noexcept : count_(count) {}
+
+    bool unique() const noexcept {
+        return count_.load(std::memory_order_acquire) == 1;
+    }
+
+    bool acquire() noexcept {
+        if constexpr (sizeof(Count) < sizeof(size_t)) {
+            Count count = count_.load(std::memory_order_relaxed);
+            do {
+                if (count == std::numeric_limits<Count>::max()) {
+                    return false;
+                }
+            } while (!count_.compare_exchange_weak(count, count + 1, std::memory_order_relaxed));
+        } else {
+            count_.fetch_add(1, std::memory_order_relaxed);
+        }
+        return true;
+    }
+
+    bool release() noexcept {
+        // The last owner cannot race with anyone, so it skips the read-modify-write.
+        if (count_.load(std::memory_order_acquire) == 1) {
+            return true;
+        }
+        return count_.fetch_sub(1, std::memory_order_acq_rel) == 1;
+    }
+};
+
+typedef basic_plain_counter<size_t> plain_counter;
+
+typedef basic_atomic_counter<size_t> atomic_counter;
+
+typedef basic_plain_counter<uint32_t> compact_counter;
+
+typedef basic_atomic_counter<uint32_t> compact_atomic_counter;
+
+// Adds a slot for the elements' hash to the block header. The elements of a shared block cannot
+// change, so its hash is computed once for all owners; 0 means it has not been yet. Concurrent
+// readers of a shared block may race to fill the slot, but they all store the same value.
+template<typename Counter>
+class hash_caching : public Counter {
+    std::atomic<size_t> hash_;
+
+public:
+    typedef typename Counter::count_type count_type;
+
+    explicit hash_caching(size_t count) noexcept : Counter(count), hash_(0) {}
+
+    size_t cached_hash() const noexcept {
+        return hash_.load(std::memory_order_relaxed);
+    }
+
+    void cache_hash(size_t hash) noexcept {
+        hash_.store(hash, std::memory_order_relaxed);
+    }
+};
+
+template<typename Counter, typename = void>
+struct caches_hash : std::false_type {};
+
+template<typename Counter>
+struct caches_hash<Counter, std::void_t<decltype(std::declval<Counter const &>().cached_hash())>> : std::true_type {};
+
+template<typename Counter>
+inline constexpr bool caches_hash_v = caches_hash<Counter>::value;
+
+// Types whose objects may be moved by copying their bytes and forgetting the source.
+// Specializations must also be nothrow move constructible.
+template<typename T>
+struct is_trivially_relocatable : std::is_trivially_copyable<T> {};
+
+template<typename T>
+inline constexpr bool is_trivially_relocatable_v = is_trivially_relocatable<T>::value;
+
+// Only names an iterator's category, so that overloads taking an iterator pair drop out for
+// other arguments, such as base_vector<int>(3, 5) or insert(pos, 3, 7).
+template<typename Iterator>
+using iterator_category_t = typename std::iterator_traits<Iterator>::iterator_category;
+
+template<typename Iterator>
+inline constexpr bool is_forward_iterator_v = std::is_base_of_v<std::forward_iterator_tag, iterator_category_t<Iterator>>;
+
+// Constructs count elements from first at dest, as a single memcpy when the source is a plain
+// array of a trivially copyable T. Random access ranges go through parallel_construct().
+template<typename T, typename ForwardIterator>
+void uninitialized_copy_counted(ForwardIterator first, size_t count, T *dest) {
+    auto copy = [first](T *chunk_dest, size_t offset, size_t chunk_count) {
+        if constexpr (std::is_trivially_copyable_v<T> && std::is_pointer_v<ForwardIterator> &&
+                      std::is_same_v<std::remove_cv_t<std::remove_pointer_t<ForwardIterator>>, T>) {
+            if (chunk_count != 0) {
+                std::memcpy(static_cast<void *>(chunk_dest), static_cast<void const *>(first + offset),
+                            chunk_count * sizeof(T));
+            }
+        } else {
+            std::uninitialized_copy_n(std::next(first, offset), chunk_count, chunk_dest);
+        }
+    };
+    if constexpr (std::is_base_of_v<std::random_access_iterator_tag, iterator_category_t<ForwardIterator>>) {
+        parallel_construct(dest, count, copy);
+    } else {
+        copy(dest, 0, count);
+    }
+}
+
+template<typename T>
+void uninitialized_fill_counted(T *dest, size_t count, T const &item) {
+    parallel_construct(dest, count, [&item](T *chunk_dest, size_t, size_t chunk_count) {
+        std::uninitialized_fill_n(chunk_dest, chunk_count, item);
+    });
+}
+
+// A read-only window over contiguous elements. It owns nothing, so reading through it never
+// unshares a copy-on-write buffer; it is invalidated by any change to the vector it came from.
+template<typename T>
+class const_span {
+    T const *data_;
+    size_t size_;
+
+public:
+    typedef T value_type;
+
+    typedef T const *iterator;
+
+    typedef T const *const_iterator;
+
+    typedef std::reverse_iterator<const_iterator> const_reverse_iterator;
+
+    typedef std::reverse_iterator<const_iterator> reverse_iterator;
+
+    typedef T const &reference;
+
+    typedef T const &const_reference;
+
+    typedef T const *pointer;
+
+    typedef T const *const_pointer;
+
+    const_span() noexcept : data_(nullptr), size_(0) {}
+
+    const_span(T const *data, size_t size) noexcept : data_(data), size_(size) {}
+
+    const_pointer data() const noexcept {
+        return data_;
+    }
+
+    size_t size() const noexcept {
+        return size_;
+    }
+
+    bool empty() const noexcept {
+        return size_ == 0;
+    }
+
+    const_iterator begin() const noexcept {
+        return data_;
+    }
+
+    const_iterator end() const noexcept {
+        return data_ + size_;
+    }
+
+    const_iterator cbegin() const noexcept {
+        return data_;
+    }
+
+    const_iterator cend() const noexcept {
+        return data_ + size_;
+    }
+
+    const_reverse_iterator rbegin() const noexcept {
+        return std::make_reverse_iterator(end());
+    }
+
+    const_reverse_iterator rend() const noexcept {
+        return std::make_reverse_iterator(begin());
+    }
+
+    const_reference operator[](size_t i) const noexcept {
+        return data_[i];
+    }
+
+    const_reference front() const noexcept {
+        return data_[0];
+    }
+
+    const_reference back() const noexcept {
+        return data_[size_ - 1];
+    }
+
+    const_span subspan(size_t offset, size_t count) const noexcept {
+        return const_span(data_ + offset, count);
+    }
+};
+
+// A writable window, handed out over elements a vector has just made room for. Like any
+// pointer into a vector, it is invalidated by the next change to that vector.
 template<typename T>
-class base_vector {
+class span {
+    T *data_;
+    size_t size_;
+
+public:
+    typedef T value_type;
+
+    typedef T *iterator;
+
+    typedef T const *const_iterator;
+
+    typedef T &reference;
+
+    typedef T const &const_reference;
+
+    typedef T *pointer;
+
+    typedef T const *const_pointer;
+
+    span() noexcept : data_(nullptr), size_(0) {}
+
+    span(T *data, size_t size) noexcept : data_(data), size_(size) {}
+
+    operator const_span<T>() const noexcept {
+        return const_span<T>(data_, size_);
+    }
+
+    pointer data() const noexcept {
+        return data_;
+    }
+
+    size_t size() const noexcept {
+        return size_;
+    }
+
+    bool empty() const noexcept {
+        return size_ == 0;
+    }
+
+    iterator begin() const noexcept {
+        return data_;
+    }
+
+    iterator end() const noexcept {
+        return data_ + size_;
+    }
+
+    reference operator[](size_t i) const noexcept {
+        return data_[i];
+    }
+
+    span subspan(size_t offset, size_t count) const noexcept {
+        return span(data_ + offset, count);
+    }
+};
+
+// Copy-on-write statistics of the calling thread, for all vector types together. They are
+// only counted when VECTOR_STATS is defined; otherwise the hooks compile to nothing and the
+// counters stay at zero.
+struct vector_stats {
+#ifdef VECTOR_STATS
+    static constexpr bool enabled = true;
+#else
+    static constexpr bool enabled = false;
+#endif
+
+    // Shared buffers replaced by a private copy before a write.
+    size_t detaches = 0;
+    // Element bytes copied out of buffers this vector could not keep sharing.
+    size_t bytes_copied = 0;
+    // Unshared blocks replaced or realloc'd because their capacity changed. Leaving a shared
+    // block is a detach, whatever the new capacity.
+    size_t reallocations = 0;
+    // Largest capacity ever allocated, in elements.
+    size_t peak_capacity = 0;
+    // Copies that shared the source's buffer instead of copying it.
+    size_t shared_copy_hits = 0;
+
+    static vector_stats &local() noexcept {
+        thread_local vector_stats stats;
+        return stats;
+    }
+
+    static void reset() noexcept {
+        local() = vector_stats();
+    }
+
+    void dump(FILE *out) const {
+        std::fprintf(out, "vector_stats: detaches %zu, bytes copied %zu, reallocations %zu, "
+                          "peak capacity %zu, shared copy hits %zu\n",
+                     detaches, bytes_copied, reallocations, peak_capacity, shared_copy_hits);
+    }
+
+    // Counters accumulated since `before`; peak_capacity is kept as is.
+    friend vector_stats operator-(vector_stats const &lhs, vector_stats const &before) noexcept {
+        vector_stats result = lhs;
+        result.detaches -= before.detaches;
+        result.bytes_copied -= before.bytes_copied;
+        result.reallocations -= before.reallocations;
+        result.shared_copy_hits -= before.shared_copy_hits;
+        return result;
+    }
+};
+
+// Growth policies pick the capacity that replaces a full buffer of the given capacity.
+// header_size and element_size describe the heap block, for policies that care about its byte size.
+template<size_t Numerator, size_t Denominator, size_t Initial = 8>
+struct geometric_growth {
+    static_assert(Numerator > Denominator, "geometric growth needs a factor above 1");
+
+    static size_t next_capacity(size_t capacity, size_t, size_t) noexcept {
+        if (capacity == 0) {
+            return Initial;
+        }
+        size_t grown = capacity / Denominator * Numerator + capacity % Denominator * Numerator / Denominator;
+        return std::max(grown, capacity + 1);
+    }
+};
+
+typedef geometric_growth<2, 1> doubling_growth;
+
+typedef geometric_growth<3, 2> one_and_a_half_growth;
+
+typedef geometric_growth<1618, 1000> golden_ratio_growth;
+
+// Rounds the block Base asks for up to the next malloc size class (four per power of two, as
+// jemalloc and tcmalloc use above 128 bytes), so the slack the allocator keeps anyway holds elements.
+template<typename Base = doubling_growth>
+struct size_class_growth {
+    static size_t next_capacity(size_t capacity, size_t header_size, size_t element_size) noexcept {
+        size_t bytes = header_size + Base::next_capacity(capacity, header_size, element_size) * element_size;
+        size_t step = 16;
+        while (step * 8 < bytes) {
+            step *= 2;
+        }
+        size_t rounded = (bytes + step - 1) / step * step;
+        return (rounded - header_size) / element_size;
+    }
+};
+
+template<typename T, typename Counter = plain_counter, typename Growth = doubling_growth,
+        typename Allocator = std::allocator<T>>
+class vector_slice;
+
+// The allocator is a private base so that stateless allocators take no space.
+template<typename T, typename Counter = plain_counter, typename Growth = doubling_growth,
+        typename Allocator = std::allocator<T>>
+class base_vector : private Allocator {
+    friend class vector_slice<T, Counter, Growth, Allocator>;
+
+    template<typename, size_t, typename, typename, typename>
+    friend class small_vector;
+
+    typedef typename Counter::count_type header_size_type;
+
+    // data_ sits at the first offset aligned for T, so over-aligned elements only need an aligned block.
     struct data_storage {
-        size_t size_;
-        size_t capacity_;
-        size_t number_of_masters_;
+        header_size_type size_;
+        header_size_type capacity_;
+        Counter number_of_masters_;
         T data_[];
     };
 
-    data_storage *storage_;
+    typedef std::allocator_traits<Allocator> allocator_traits;
+
+    // Copies share the block unless the allocators differ or a narrow counter is full; only
+    // then do they copy the elements, which may throw.
+    static constexpr bool nothrow_copy = allocator_traits::is_always_equal::value &&
+                                         sizeof(header_size_type) >= sizeof(size_t);
+
+    // The allocation grain: as aligned as the header and data_, and no bigger.
+    struct alignas(data_storage) storage_unit {
+        unsigned char bytes[alignof(data_storage)];
+    };
+
+    typedef typename allocator_traits::template rebind_alloc<storage_unit> storage_allocator;
+
+    typedef std::allocator_traits<storage_allocator> storage_traits;
+
+    static_assert(std::is_same_v<typename storage_traits::pointer, storage_unit *>,
+                  "base_vector needs an allocator with raw pointers");
+
+    static_assert(!is_trivially_relocatable_v<T> || std::is_nothrow_move_constructible_v<T>,
+                  "trivially relocatable types must be nothrow move constructible");
+
+    // std::allocator blocks of trivially relocatable elements come from malloc so that realloc can grow them.
+    // malloc does not honour extended alignment, so over-aligned elements stay with the allocator.
+    // Builds with VECTOR_FAULT_INJECTION keep every block on operator new, where faults are injected.
+#ifdef VECTOR_FAULT_INJECTION
+    static constexpr bool uses_malloc = false;
+#else
+    static constexpr bool uses_malloc = is_trivially_relocatable_v<T> && std::is_same_v<Allocator, std::allocator<T>> &&
+                                        alignof(data_storage) <= alignof(std::max_align_t);
+#endif
+
+    // A header narrower than size_t cannot describe a bigger block; such vectors need a size_t counter.
+    inline static void check_capacity(size_t capacity) {
+        if (capacity > std::numeric_limits<header_size_type>::max()) {
+            throw std::length_error("base_vector capacity does not fit the block header");
+        }
+    }
+
+    data_storage *storage_;
+
+    // Blocks are allocated in aligned units so that data_ stays aligned.
+    inline static size_t storage_units(size_t capacity) noexcept {
+        return (sizeof(data_storage) + capacity * sizeof(T) + sizeof(storage_unit) - 1) / sizeof(storage_unit);
+    }
+
+    inline static void note_capacity(size_t capacity) noexcept {
+        if constexpr (vector_stats::enabled) {
+            vector_stats &stats = vector_stats::local();
+            stats.peak_capacity = std::max(stats.peak_capacity, capacity);
+        }
+    }
+
+    data_storage *create_storage(size_t capacity) {
+        check_capacity(capacity);
+        note_capacity(capacity);
+        data_storage *storage;
+        if constexpr (uses_malloc) {
+            storage = static_cast<data_storage *>(std::malloc(sizeof(data_storage) + capacity * sizeof(T)));
+            if (!storage) {
+                throw std::bad_alloc();
+            }
+        } else {
+            storage_allocator storage_alloc(get_allocator());
+            storage = reinterpret_cast<data_storage *>(storage_traits::allocate(storage_alloc, storage_units(capacity)));
+        }
+        storage->capacity_ = capacity;
+        return storage;
+    }
+
+    void free_storage(data_storage *storage) noexcept {
+        if constexpr (uses_malloc) {
+            std::free(storage);
+        } else {
+            storage_allocator storage_alloc(get_allocator());
+            storage_traits::deallocate(storage_alloc, reinterpret_cast<storage_unit *>(storage),
+                                       storage_units(storage->capacity_));
+        }
+    }
+
+    Allocator &allocator() noexcept {
+        return *this;
+    }
+
+    bool same_allocator(base_vector const &rhs) const noexcept {
+        return allocator_traits::is_always_equal::value || get_allocator() == rhs.get_allocator();
+    }
+
+    inline static void init_storage(data_storage *storage, size_t size, size_t capacity) noexcept {
+        storage->size_ = size;
+        storage->capacity_ = capacity;
+        new(&storage->number_of_masters_) Counter(1);
+    }
+
+    void release_storage(data_storage *storage) noexcept {
+        if (storage && storage->number_of_masters_.release()) {
+            destroy_storage(storage);
+        }
+    }
+
+    // The last owner's cleanup. It stays out of line, as shared_ptr's does: releasing is inlined
+    // into every copy and write, which then neither grow by it nor show the compiler a free of a
+    // block that another owner still points to.
+    VECTOR_NOINLINE void destroy_storage(data_storage *storage) noexcept {
+        std::destroy(storage->data_, storage->data_ + storage->size_);
+        free_storage(storage);
+    }
+
+    bool is_shared() const noexcept {
+        return storage_ && !storage_->number_of_masters_.unique();
+    }
+
+    bool can_reallocate() const noexcept {
+        return uses_malloc && storage_ && !is_shared();
+    }
+
+    // Changes the capacity of an unshared block, in place when the allocator can manage it.
+    void reallocate(size_t new_capacity) {
+        check_capacity(new_capacity);
+        void *block = std::realloc(static_cast<void *>(storage_), sizeof(data_storage) + new_capacity * sizeof(T));
+        if (!block) {
+            throw std::bad_alloc();
+        }
+        // The old pointer is dead from here on; everything goes through storage_.
+        storage_ = static_cast<data_storage *>(block);
+        storage_->capacity_ = new_capacity;
+        note_capacity(new_capacity);
+        if constexpr (vector_stats::enabled) {
+            ++vector_stats::local().reallocations;
+        }
+    }
+
+    // Swaps in a fully built block for the current one, recording why it was needed.
+    void replace_storage(data_storage *new_storage) noexcept {
+        if constexpr (vector_stats::enabled) {
+            if (storage_) {
+                vector_stats &stats = vector_stats::local();
+                if (is_shared()) {
+                    ++stats.detaches;
+                    stats.bytes_copied += std::min<size_t>(storage_->size_, new_storage->size_) * sizeof(T);
+                } else if (new_storage->capacity_ != storage_->capacity_) {
+                    ++stats.reallocations;
+                }
+            }
+        }
+        release_storage(storage_);
+        storage_ = new_storage;
+    }
+
+    // Constructs [first, last) of the current buffer at dest. Elements are moved out when this
+    // owner is the only one and moving cannot throw, so a failed copy leaves the source intact.
+    void relocate(size_t first, size_t last, T *dest) {
+        if constexpr (std::is_nothrow_move_constructible_v<T>) {
+            if (storage_ && !is_shared()) {
+                std::uninitialized_move(storage_->data_ + first, storage_->data_ + last, dest);
+                return;
+            }
+        }
+        uninitialized_copy_counted(cbegin() + first, last - first, dest);
+    }
+
+    // Private copy of storage, made with this vector's allocator.
+    data_storage *clone_storage(data_storage const *storage) {
+        auto *new_storage_ = create_storage(storage->capacity_);
+        try {
+            uninitialized_copy_counted(storage->data_, storage->size_, new_storage_->data_);
+        } catch (...) {
+            free_storage(new_storage_);
+            throw;
+        }
+        init_storage(new_storage_, storage->size_, storage->capacity_);
+        return new_storage_;
+    }
+
+    // Starts owning rhs's block: shared when both allocators can free it and its counter has
+    // room for another owner, copied otherwise.
+    void acquire_storage(base_vector const &rhs) {
+        if (!rhs.storage_) {
+            storage_ = nullptr;
+            return;
+        }
+        if (same_allocator(rhs)) {
+            if constexpr (caches_hash_v<Counter>) {
+                // While rhs was the only owner, its elements were free to change.
+                if (rhs.storage_->number_of_masters_.unique()) {
+                    rhs.storage_->number_of_masters_.cache_hash(0);
+                }
+            }
+            if (rhs.storage_->number_of_masters_.acquire()) {
+                storage_ = rhs.storage_;
+                if constexpr (vector_stats::enabled) {
+                    ++vector_stats::local().shared_copy_hits;
+                }
+                return;
+            }
+        }
+        storage_ = clone_storage(rhs.storage_);
+        if constexpr (vector_stats::enabled) {
+            vector_stats::local().bytes_copied += storage_->size_ * sizeof(T);
+        }
+    }
+
+    // Inserts count elements that construct(dest) builds at dest, which may read from this very
+    // vector. A new block is allocated at most once and gets prefix, new elements and suffix in
+    // one pass; otherwise the new elements are built at the end and rotated into place.
+    template<typename Construct>
+    T *insert_n(T const *pos, size_t count, Construct construct) {
+        size_t index = pos - cbegin();
+        if (count == 0) {
+            return begin() + index;
+        }
+        size_t new_size = size() + count;
+        if (new_size > capacity() || is_shared()) {
+            size_t new_capacity = capacity();
+            if (new_size > capacity()) {
+                new_capacity = std::max(new_size, next_capacity(capacity()));
+            }
+            auto *new_storage_ = create_storage(new_capacity);
+            try {
+                construct(new_storage_->data_ + index);
+            } catch (...) {
+                free_storage(new_storage_);
+                throw;
+            }
+            try {
+                relocate(0, index, new_storage_->data_);
+            } catch (...) {
+                std::destroy(new_storage_->data_ + index, new_storage_->data_ + index + count);
+                free_storage(new_storage_);
+                throw;
+            }
+            try {
+                relocate(index, size(), new_storage_->data_ + index + count);
+            } catch (...) {
+                std::destroy(new_storage_->data_, new_storage_->data_ + index + count);
+                free_storage(new_storage_);
+                throw;
+            }
+            init_storage(new_storage_, new_size, new_capacity);
+            replace_storage(new_storage_);
+            return storage_->data_ + index;
+        }
+        size_t old_size = size();
+        construct(storage_->data_ + old_size);
+        storage_->size_ = new_size;
+        std::rotate(storage_->data_ + index, storage_->data_ + old_size, storage_->data_ + new_size);
+        return storage_->data_ + index;
+    }
+
+    void broot_copy() {
+        if (!is_shared()) {
+            return;
+        }
+        auto *new_storage_ = clone_storage(storage_);
+        replace_storage(new_storage_);
+    }
+
+public:
+    typedef T value_type;
+
+    typedef T *iterator;
+
+    typedef T const *const_iterator;
+
+    typedef std::reverse_iterator<iterator> reverse_iterator;
+
+    typedef std::reverse_iterator<const_iterator> const_reverse_iterator;
+
+    typedef T &reference;
+
+    typedef T const &const_reference;
+
+    typedef T *pointer;
+
+    typedef T const *const_pointer;
+
+    typedef Allocator allocator_type;
+
+    static size_t next_capacity(size_t capacity) noexcept {
+        return Growth::next_capacity(capacity, sizeof(data_storage), sizeof(T));
+    }
+
+    base_vector() noexcept(noexcept(Allocator())) : storage_(nullptr) {}
+
+    explicit base_vector(Allocator const &allocator) noexcept : Allocator(allocator), storage_(nullptr) {}
+
+    base_vector(base_vector const &rhs) noexcept(nothrow_copy)
+            : Allocator(allocator_traits::select_on_container_copy_construction(rhs.get_allocator())) {
+        acquire_storage(rhs);
+    }
+
+    base_vector(base_vector &&rhs) noexcept : Allocator(rhs.get_allocator()), storage_(rhs.storage_) {
+        rhs.storage_ = nullptr;
+    }
+
+    // Forward ranges are measured and copied into an exact-size block; single-pass ones, such as
+    // istream_iterator, can only be read once and grow the buffer as they go.
+    template<typename InputIterator, typename = iterator_category_t<InputIterator>>
+    base_vector(InputIterator first, InputIterator last, Allocator const &allocator = Allocator())
+            : Allocator(allocator), storage_(nullptr) {
+        if constexpr (is_forward_iterator_v<InputIterator>) {
+            auto count = static_cast<size_t>(std::distance(first, last));
+            if (count != 0) {
+                storage_ = create_storage(count);
+                try {
+                    uninitialized_copy_counted(first, count, storage_->data_);
+                } catch (...) {
+                    free_storage(storage_);
+                    storage_ = nullptr;
+                    throw;
+                }
+                init_storage(storage_, count, count);
+            }
+        } else {
+            try {
+                for (; first != last; ++first) {
+                    emplace_back(*first);
+                }
+            } catch (...) {
+                release_storage(storage_);
+                throw;
+            }
+        }
+    }
+
+    base_vector(size_t count, const_reference item, Allocator const &allocator = Allocator())
+            : Allocator(allocator) {
+        if (count < 1) {
+            storage_ = nullptr;
+        } else {
+            storage_ = create_storage(count);
+            try {
+                uninitialized_fill_counted(storage_->data_, count, item);
+            } catch (...) {
+                free_storage(storage_);
+                storage_ = nullptr;
+                throw;
+            }
+            init_storage(storage_, count, count);
+        }
+    }
+
+    base_vector &operator=(base_vector const &rhs) noexcept(nothrow_copy) {
+        if (rhs.storage_ == storage_) {
+            return *this;
+        }
+        if constexpr (allocator_traits::propagate_on_container_copy_assignment::value) {
+            if (!same_allocator(rhs)) {
+                // The old block has to go back to the allocator that made it.
+                release_storage(storage_);
+                storage_ = nullptr;
+            }
+            allocator() = rhs.get_allocator();
+        }
+        data_storage *old_storage = storage_;
+        acquire_storage(rhs);
+        release_storage(old_storage);
+        return *this;
+    }
+
+    base_vector &operator=(base_vector &&rhs) noexcept(allocator_traits::propagate_on_container_move_assignment::value ||
+                                                       allocator_traits::is_always_equal::value) {
+        if (this == &rhs) {
+            return *this;
+        }
+        if (!allocator_traits::propagate_on_container_move_assignment::value && !same_allocator(rhs)) {
+            return *this = static_cast<base_vector const &>(rhs);
+        }
+        release_storage(storage_);
+        if constexpr (allocator_traits::propagate_on_container_move_assignment::value) {
+            allocator() = rhs.get_allocator();
+        }
+        storage_ = rhs.storage_;
+        rhs.storage_ = nullptr;
+        return *this;
+    }
+
+    template<typename InputIterator, typename = iterator_category_t<InputIterator>>
+    void assign(InputIterator first, InputIterator last) {
+        *this = base_vector(first, last, get_allocator());
+    }
+
+    allocator_type get_allocator() const noexcept {
+        return *this;
+    }
+
+    pointer data() {
+        broot_copy();
+        return storage_ ? storage_->data_ : nullptr;
+    }
+
+    const_pointer data() const noexcept {
+        return storage_ ? storage_->data_ : nullptr;
+    }
+
+    // Read-only access that leaves a shared buffer shared; the non-const accessors unshare it.
+    base_vector const &cview() const noexcept {
+        return *this;
+    }
+
+    const_span<T> as_const_span() const noexcept {
+        return const_span<T>(data(), size());
+    }
+
+    // Consistent with ==. With a hash_caching counter, a shared block is hashed only once; an
+    // unshared one may have been written through a pointer since, so it is always rehashed.
+    size_t hash() const {
+        if constexpr (caches_hash_v<Counter>) {
+            if (is_shared()) {
+                size_t result = storage_->number_of_masters_.cached_hash();
+                if (result == 0) {
+                    result = elements_hash(cbegin(), size());
+                    storage_->number_of_masters_.cache_hash(result);
+                }
+                return result;
+            }
+        }
+        return elements_hash(cbegin(), size());
+    }
+
+    vector_slice<T, Counter, Growth, Allocator> slice(size_t offset, size_t count) const {
+        return vector_slice<T, Counter, Growth, Allocator>(*this, offset, count);
+    }
+
+    iterator begin() {
+        broot_copy();
+        return storage_ ? storage_->data_ : nullptr;
+    }
+
+    iterator end() {
+        broot_copy();
+        return storage_ ? storage_->data_ + storage_->size_ : nullptr;
+    }
+
+    const_iterator begin() const noexcept {
+        return storage_ ? storage_->data_ : nullptr;
+    }
+
+    const_iterator end() const noexcept {
+        return storage_ ? storage_->data_ + storage_->size_ : nullptr;
+    }
+
+    const_iterator cbegin() const noexcept {
+        return storage_ ? storage_->data_ : nullptr;
+    }
+
+    const_iterator cend() const noexcept {
+        return storage_ ? storage_->data_ + storage_->size_ : nullptr;
+    }
+
+    reverse_iterator rbegin() {
+        return std::make_reverse_iterator(end());
+    }
+
+    reverse_iterator rend() {
+        return std::make_reverse_iterator(begin());
+    }
+
+    const_reverse_iterator rbegin() const noexcept {
+        return std::make_reverse_iterator(cend());
+    }
+
+    const_reverse_iterator rend() const noexcept {
+        return std::make_reverse_iterator(cbegin());
+    }
+
+    const_reverse_iterator crbegin() const noexcept {
+        return std::make_reverse_iterator(cend());
+    }
+
+    const_reverse_iterator crend() const noexcept {
+        return std::make_reverse_iterator(cbegin());
+    }
+
+    reference operator[](size_t pos) {
+        broot_copy();
+        return storage_->data_[pos];
+    }
+
+    const_reference operator[](size_t pos) const {
+        return storage_->data_[pos];
+    }
+
+    reference front() {
+        return operator[](0);
+    }
+
+    const_reference front() const {
+        return operator[](0);
+    }
+
+    reference back() {
+        return operator[](storage_->size_ - 1);
+    }
+
+    const_reference back() const {
+        return operator[](storage_->size_ - 1);
+    }
+
+    bool empty() const noexcept {
+        return storage_ ? storage_->size_ == 0 : true;
+    }
+
+    size_t size() const noexcept {
+        return storage_ ? storage_->size_ : 0;
+    }
+
+    size_t capacity() const noexcept {
+        return storage_ ? storage_->capacity_ : 0;
+    }
+
+    void reserve(size_t new_capacity) {
+        if (new_capacity <= capacity()) {
+            return;
+        }
+        if (can_reallocate()) {
+            reallocate(new_capacity);
+            return;
+        }
+        auto *new_storage_ = create_storage(new_capacity);
+        try {
+            relocate(0, size(), new_storage_->data_);
+        } catch (...) {
+            free_storage(new_storage_);
+            throw;
+        }
+        if (!storage_) {
+            init_storage(new_storage_, 0, new_capacity);
+            storage_ = new_storage_;
+            return;
+        }
+        init_storage(new_storage_, storage_->size_, new_capacity);
+
+        replace_storage(new_storage_);
+    }
+
+    void resize(size_t new_size) {
+        if (new_size == size()) {
+            return;
+        }
+        if (new_size < size()) {
+            if (is_shared()) {
+                auto *new_storage_ = create_storage(storage_->capacity_);
+                try {
+                    uninitialized_copy_counted(cbegin(), new_size, new_storage_->data_);
+                } catch (...) {
+                    free_storage(new_storage_);
+                    throw;
+                }
+                init_storage(new_storage_, new_size, storage_->capacity_);
+                replace_storage(new_storage_);
+            } else {
+                std::destroy(begin() + new_size, end());
+                storage_->size_ = new_size;
+            }
+        } else {
+            size_t new_capacity = std::max(new_size, capacity());
+            if (new_capacity > capacity() && can_reallocate()) {
+                reallocate(new_capacity);
+                uninitialized_fill_counted(end(), new_size - size(), T());
+                storage_->size_ = new_size;
+            } else if (!storage_ || is_shared() || new_capacity > capacity()) {
+                auto *new_storage_ = create_storage(new_capacity);
+                try {
+                    uninitialized_fill_counted(new_storage_->data_ + size(), new_size - size(), T());
+                } catch (...) {
+                    free_storage(new_storage_);
+                    throw;
+                }
+                try {
+                    relocate(0, size(), new_storage_->data_);
+                } catch (...) {
+                    std::destroy(new_storage_->data_ + size(), new_storage_->data_ + new_size);
+                    free_storage(new_storage_);
+                    throw;
+                }
+                init_storage(new_storage_, new_size, new_capacity);
+                replace_storage(new_storage_);
+            } else {
+                uninitialized_fill_counted(end(), new_size - size(), T());
+                storage_->size_ = new_size;
+            }
+        }
+    }
+
+    void resize(size_t new_size, const_reference item) {
+        if (new_size == size()) {
+            return;
+        }
+        if (new_size < size()) {
+            if (is_shared()) {
+                auto *new_storage_ = create_storage(storage_->capacity_);
+                try {
+                    uninitialized_copy_counted(cbegin(), new_size, new_storage_->data_);
+                } catch (...) {
+                    free_storage(new_storage_);
+                    throw;
+                }
+                init_storage(new_storage_, new_size, storage_->capacity_);
+                replace_storage(new_storage_);
+            } else {
+                std::destroy(begin() + new_size, end());
+                storage_->size_ = new_size;
+            }
+        } else {
+            size_t new_capacity = std::max(new_size, capacity());
+            if (new_capacity > capacity() && can_reallocate()) {
+                T copy(item);
+                reallocate(new_capacity);
+                uninitialized_fill_counted(end(), new_size - size(), copy);
+                storage_->size_ = new_size;
+            } else if (!storage_ || is_shared() || new_capacity > capacity()) {
+                auto *new_storage_ = create_storage(new_capacity);
+                try {
+                    uninitialized_fill_counted(new_storage_->data_ + size(), new_size - size(), item);
+                } catch (...) {
+                    free_storage(new_storage_);
+                    throw;
+                }
+                try {
+                    relocate(0, size(), new_storage_->data_);
+                } catch (...) {
+                    std::destroy(new_storage_->data_ + size(), new_storage_->data_ + new_size);
+                    free_storage(new_storage_);
+                    throw;
+                }
+                init_storage(new_storage_, new_size, new_capacity);
+                replace_storage(new_storage_);
+            } else {
+                uninitialized_fill_counted(end(), new_size - size(), item);
+                storage_->size_ = new_size;
+            }
+        }
+    }
+
+    void shrink_to_fit() {
+        if (size() == capacity()) {
+            return;
+        }
+        if (size() == 0) {
+            release_storage(storage_);
+            storage_ = nullptr;
+            return;
+        }
+        if (can_reallocate()) {
+            reallocate(storage_->size_);
+            return;
+        }
+        auto *new_storage_ = create_storage(storage_->size_);
+        try {
+            relocate(0, size(), new_storage_->data_);
+        } catch (...) {
+            free_storage(new_storage_);
+            throw;
+        }
+        init_storage(new_storage_, storage_->size_, storage_->size_);
+
+        replace_storage(new_storage_);
+    }
+
+    void clear() {
+        resize(0);
+    }
+
+    template<typename... Args>
+    reference emplace_back(Args &&... args) {
+        if (size() == capacity() && can_reallocate()) {
+            // args may refer to an element that realloc is about to move.
+            T item(std::forward<Args>(args)...);
+            reallocate(next_capacity(capacity()));
+            new(storage_->data_ + storage_->size_) T(std::move(item));
+            ++storage_->size_;
+        } else if (size() == capacity() || is_shared()) {
+            size_t new_capacity = (size() == capacity() ? next_capacity(capacity()) : capacity());
+            auto *new_storage_ = create_storage(new_capacity);
+            try {
+                new(new_storage_->data_ + size()) T(std::forward<Args>(args)...);
+            } catch (...) {
+                free_storage(new_storage_);
+                throw;
+            }
+            try {
+                relocate(0, size(), new_storage_->data_);
+            } catch (...) {
+                new_storage_->data_[size()].~T();
+                free_storage(new_storage_);
+                throw;
+            }
+
+            if (!storage_) {
+                init_storage(new_storage_, 1, new_capacity);
+                storage_ = new_storage_;
+                return storage_->data_[0];
+            }
+            init_storage(new_storage_, storage_->size_ + 1, new_capacity);
+
+            replace_storage(new_storage_);
+        } else {
+            try {
+                new(storage_->data_ + storage_->size_) T(std::forward<Args>(args)...);
+                ++storage_->size_;
+            } catch (...) {
+                throw;
+            }
+        }
+        return storage_->data_[storage_->size_ - 1];
+    }
+
+    void push_back(const_reference item) {
+        emplace_back(item);
+    }
+
+    void push_back(value_type &&item) {
+        emplace_back(std::move(item));
+    }
+
+    void pop_back() {
+        if (is_shared()) {
+            erase(cend() - 1, cend());
+            return;
+        }
+        storage_->data_[--storage_->size_].~T();
+    }
+
+    template<typename... Args>
+    iterator emplace(const_iterator pos, Args &&... args) {
+        size_t index = pos - cbegin();
+        if (pos == cend()) {
+            emplace_back(std::forward<Args>(args)...);
+            return begin() + index;
+        }
+        if (size() == capacity() && can_reallocate()) {
+            T copy(std::forward<Args>(args)...);
+            reallocate(next_capacity(capacity()));
+            new(storage_->data_ + storage_->size_) T(std::move(copy));
+            ++storage_->size_;
+            std::rotate(begin() + index, end() - 1, end());
+            return begin() + index;
+        }
+        if (size() == capacity() || is_shared()) {
+            size_t new_capacity = (size() == capacity() ? next_capacity(capacity()) : capacity());
+
+            auto *new_storage_ = create_storage(new_capacity);
+
+            try {
+                new(new_storage_->data_ + index) T(std::forward<Args>(args)...);
+            } catch (...) {
+                free_storage(new_storage_);
+                throw;
+            }
+            try {
+                relocate(0, index, new_storage_->data_);
+            } catch (...) {
+                new_storage_->data_[index].~T();
+                free_storage(new_storage_);
+                throw;
+            }
+            try {
+                relocate(index, size(), new_storage_->data_ + index + 1);
+            } catch (...) {
+                std::destroy(new_storage_->data_, new_storage_->data_ + index + 1);
+                free_storage(new_storage_);
+                throw;
+            }
+
+            init_storage(new_storage_, storage_->size_ + 1, new_capacity);
+
+            replace_storage(new_storage_);
+            return begin() + index;
+        }
+        new(storage_->data_ + storage_->size_) T(std::forward<Args>(args)...);
+        ++storage_->size_;
+        std::rotate(begin() + index, end() - 1, end());
+//        for (iterator r = end() - 1; r > begin() + index; r--) {
+//            std::iter_swap(r, r - 1);
+//        }
+        return begin() + index;
+    }
+
+    iterator insert(const_iterator pos, const_reference item) {
+        return emplace(pos, item);
+    }
+
+    iterator insert(const_iterator pos, value_type &&item) {
+        return emplace(pos, std::move(item));
+    }
+
+    iterator insert(const_iterator pos, size_t count, const_reference item) {
+        return insert_n(pos, count, [&item, count](T *dest) {
+            uninitialized_fill_counted(dest, count, item);
+        });
+    }
+
+    template<typename InputIterator, typename = iterator_category_t<InputIterator>>
+    iterator insert(const_iterator pos, InputIterator first, InputIterator last) {
+        if constexpr (is_forward_iterator_v<InputIterator>) {
+            auto count = static_cast<size_t>(std::distance(first, last));
+            return insert_n(pos, count, [first, count](T *dest) {
+                uninitialized_copy_counted(first, count, dest);
+            });
+        } else {
+            // A single-pass range has to be read before its size is known.
+            size_t index = pos - cbegin();
+            base_vector items(get_allocator());
+            for (; first != last; ++first) {
+                items.push_back(*first);
+            }
+            return insert(cbegin() + index, std::make_move_iterator(items.begin()),
+                          std::make_move_iterator(items.end()));
+        }
+    }
+
+    template<typename Range>
+    void append_range(Range const &range) {
+        insert(cend(), std::begin(range), std::end(range));
+    }
+
+    // Makes room for count more elements and returns it for the caller to fill, e.g. from a read().
+    // The new elements are default-initialized, so for trivial types their values are unspecified.
+    span<T> append_uninitialized(size_t count) {
+        size_t new_size = size() + count;
+        if (new_size > capacity() && can_reallocate()) {
+            reallocate(std::max(new_size, next_capacity(capacity())));
+        }
+        return span<T>(insert_n(cend(), count, [count](T *dest) {
+            std::uninitialized_default_construct_n(dest, count);
+        }), count);
+    }
+
+    // resize() that default-initializes instead of value-initializing, so nothing is zeroed.
+    void resize_default_init(size_t new_size) {
+        if (new_size < size()) {
+            erase(cbegin() + new_size, cend());
+        } else if (new_size > size()) {
+            append_uninitialized(new_size - size());
+        }
+    }
+
+    iterator erase(const_iterator pos) {
+        return erase(pos, pos + 1);
+    }
+
+    iterator erase(const_iterator first, const_iterator last) {
+        size_t indexl = first - cbegin();
+        size_t indexr = last - cbegin();
+        if (first == last) {
+            return begin() + indexl;
+        }
+
+        // A shared buffer is never copied whole: the new block gets only the survivors.
+        if (is_shared()) {
+            auto *new_storage_ = create_storage(storage_->capacity_);
+
+            try {
+                uninitialized_copy_counted(cbegin(), indexl, new_storage_->data_);
+            } catch (...) {
+                free_storage(new_storage_);
+                throw;
+            }
+            try {
+                uninitialized_copy_counted(last, size() - indexr, new_storage_->data_ + indexl);
+            } catch (...) {
+                std::destroy(new_storage_->data_, new_storage_->data_ + indexl);
+                free_storage(new_storage_);
+                throw;
+            }
+
+            init_storage(new_storage_, storage_->size_ - (indexr - indexl), storage_->capacity_);
+
+            replace_storage(new_storage_);
+            return begin() + indexl;
+        }
+        if (last == cend()) {
+            std::destroy(begin() + indexl, end());
+            storage_->size_ -= (indexr - indexl);
+            return begin() + indexl;
+        }
+        std::move(begin() + indexr, end(), begin() + indexl);
+//        for (iterator l = begin() + indexl, r = begin() + indexr; r < end(); l++, r++) {
+//            *l = *r;
+//        }
+        std::destroy(begin() + size() - (indexr - indexl), end());
+        storage_->size_ -= (indexr - indexl);
+        return begin() + indexl;
+    }
 
-    inline static data_storage *create_storage(size_t capacity) {
-        return static_cast<data_storage *>(operator new(sizeof(data_storage) + capacity * sizeof(T)));
+    // Cheap answers first: the same block, different sizes, or different cached hashes.
+    friend bool operator==(base_vector const &lhs, base_vector const &rhs) {
+        if (lhs.storage_ == rhs.storage_) {
+            return true;
+        }
+        if (lhs.size() != rhs.size()) {
+            return false;
+        }
+        if constexpr (caches_hash_v<Counter>) {
+            if (lhs.is_shared() && rhs.is_shared()) {
+                size_t lhs_hash = lhs.storage_->number_of_masters_.cached_hash();
+                size_t rhs_hash = rhs.storage_->number_of_masters_.cached_hash();
+                if (lhs_hash != 0 && rhs_hash != 0 && lhs_hash != rhs_hash) {
+                    return false;
+                }
+            }
+        }
+        return elements_equal(lhs.cbegin(), lhs.size(), rhs.cbegin(), rhs.size());
     }
 
-    void broot_copy() {
-        if (!storage_ || storage_->number_of_masters_ == 1) {
+    friend bool operator!=(base_vector const &lhs, base_vector const &rhs) {
+        return !(lhs == rhs);
+    }
+
+    friend bool operator<(base_vector const &lhs, base_vector const &rhs) {
+        if (lhs.storage_ == rhs.storage_) {
+            return false;
+        }
+        return elements_less(lhs.cbegin(), lhs.size(), rhs.cbegin(), rhs.size());
+    }
+
+    friend bool operator>(base_vector const &lhs, base_vector const &rhs) {
+        return rhs < lhs;
+    }
+
+    friend bool operator<=(base_vector const &lhs, base_vector const &rhs) {
+        return !(lhs > rhs);
+    }
+
+    friend bool operator>=(base_vector const &lhs, base_vector const &rhs) {
+        return !(lhs < rhs);
+    }
+
+    friend void swap(base_vector &lhs, base_vector &rhs) noexcept {
+        if constexpr (allocator_traits::propagate_on_container_swap::value) {
+            using std::swap;
+            swap(lhs.allocator(), rhs.allocator());
+        }
+        std::swap(lhs.storage_, rhs.storage_);
+    }
+
+    ~base_vector() {
+        release_storage(storage_);
+    }
+};
+
+// A window [offset, offset + size) into a base_vector's buffer. Making one, or a slice of one,
+// only takes another reference to the buffer. Element access through a non-const slice first
+// copies the window into a private buffer, unless the slice is already the buffer's only owner.
+template<typename T, typename Counter, typename Growth, typename Allocator>
+class vector_slice {
+    typedef base_vector<T, Counter, Growth, Allocator> heap_vector;
+
+    heap_vector items_;
+    size_t offset_;
+    size_t size_;
+
+    void materialize() {
+        if (!items_.is_shared()) {
             return;
         }
-        auto *new_storage_ = create_storage(storage_->capacity_);
+        heap_vector copy(items_.cbegin() + offset_, items_.cbegin() + offset_ + size_, items_.get_allocator());
+        swap(items_, copy);
+        offset_ = 0;
+    }
+
+public:
+    typedef T value_type;
+
+    typedef T *iterator;
+
+    typedef T const *const_iterator;
+
+    typedef std::reverse_iterator<iterator> reverse_iterator;
+
+    typedef std::reverse_iterator<const_iterator> const_reverse_iterator;
+
+    typedef T &reference;
+
+    typedef T const &const_reference;
+
+    typedef T *pointer;
+
+    typedef T const *const_pointer;
+
+    typedef Allocator allocator_type;
+
+    vector_slice() noexcept(noexcept(Allocator())) : offset_(0), size_(0) {}
+
+    explicit vector_slice(heap_vector const &items) noexcept(noexcept(heap_vector(items)))
+            : items_(items), offset_(0), size_(items.size()) {}
+
+    vector_slice(heap_vector const &items, size_t offset, size_t count) noexcept(noexcept(heap_vector(items)))
+            : items_(items), offset_(offset), size_(count) {}
+
+    vector_slice slice(size_t offset, size_t count) const noexcept(noexcept(heap_vector(items_))) {
+        return vector_slice(items_, offset_ + offset, count);
+    }
+
+    void remove_prefix(size_t count) noexcept {
+        offset_ += count;
+        size_ -= count;
+    }
+
+    void remove_suffix(size_t count) noexcept {
+        size_ -= count;
+    }
+
+    // A vector with the window's elements; it shares the buffer when the window covers all of it.
+    heap_vector to_vector() const {
+        if (offset_ == 0 && size_ == items_.size()) {
+            return items_;
+        }
+        return heap_vector(cbegin(), cend(), items_.get_allocator());
+    }
+
+    allocator_type get_allocator() const noexcept {
+        return items_.get_allocator();
+    }
+
+    pointer data() {
+        materialize();
+        return items_.data() + offset_;
+    }
+
+    const_pointer data() const noexcept {
+        return items_.cbegin() + offset_;
+    }
+
+    vector_slice const &cview() const noexcept {
+        return *this;
+    }
+
+    const_span<T> as_const_span() const noexcept {
+        return const_span<T>(data(), size_);
+    }
+
+    size_t hash() const {
+        return elements_hash(data(), size_);
+    }
+
+    iterator begin() {
+        return data();
+    }
+
+    iterator end() {
+        return data() + size_;
+    }
+
+    const_iterator begin() const noexcept {
+        return data();
+    }
+
+    const_iterator end() const noexcept {
+        return data() + size_;
+    }
+
+    const_iterator cbegin() const noexcept {
+        return data();
+    }
+
+    const_iterator cend() const noexcept {
+        return data() + size_;
+    }
+
+    reverse_iterator rbegin() {
+        return std::make_reverse_iterator(end());
+    }
+
+    reverse_iterator rend() {
+        return std::make_reverse_iterator(begin());
+    }
+
+    const_reverse_iterator rbegin() const noexcept {
+        return std::make_reverse_iterator(cend());
+    }
+
+    const_reverse_iterator rend() const noexcept {
+        return std::make_reverse_iterator(cbegin());
+    }
+
+    const_reverse_iterator crbegin() const noexcept {
+        return std::make_reverse_iterator(cend());
+    }
+
+    const_reverse_iterator crend() const noexcept {
+        return std::make_reverse_iterator(cbegin());
+    }
+
+    reference operator[](size_t i) {
+        return data()[i];
+    }
+
+    const_reference operator[](size_t i) const noexcept {
+        return data()[i];
+    }
+
+    reference front() {
+        return data()[0];
+    }
+
+    const_reference front() const noexcept {
+        return data()[0];
+    }
+
+    reference back() {
+        return data()[size_ - 1];
+    }
+
+    const_reference back() const noexcept {
+        return data()[size_ - 1];
+    }
+
+    bool empty() const noexcept {
+        return size_ == 0;
+    }
+
+    size_t size() const noexcept {
+        return size_;
+    }
+
+    friend bool operator==(vector_slice const &lhs, vector_slice const &rhs) {
+        if (lhs.size_ != rhs.size_) {
+            return false;
+        }
+        if (lhs.data() == rhs.data()) {
+            return true;
+        }
+        return elements_equal(lhs.data(), lhs.size_, rhs.data(), rhs.size_);
+    }
+
+    friend bool operator!=(vector_slice const &lhs, vector_slice const &rhs) {
+        return !(lhs == rhs);
+    }
+
+    friend bool operator<(vector_slice const &lhs, vector_slice const &rhs) {
+        return elements_less(lhs.data(), lhs.size_, rhs.data(), rhs.size_);
+    }
+
+    friend bool operator>(vector_slice const &lhs, vector_slice const &rhs) {
+        return rhs < lhs;
+    }
+
+    friend bool operator<=(vector_slice const &lhs, vector_slice const &rhs) {
+        return !(lhs > rhs);
+    }
+
+    friend bool operator>=(vector_slice const &lhs, vector_slice const &rhs) {
+        return !(lhs < rhs);
+    }
+
+    friend void swap(vector_slice &lhs, vector_slice &rhs) noexcept {
+        swap(lhs.items_, rhs.items_);
+        std::swap(lhs.offset_, rhs.offset_);
+        std::swap(lhs.size_, rhs.size_);
+    }
+};
+
+template<typename T, size_t N, typename Counter = plain_counter, typename Growth = doubling_growth,
+        typename Allocator = std::allocator<T>>
+class small_vector {
+    typedef base_vector<T, Counter, Growth, Allocator> heap_vector;
+
+    // heap_ is empty unless the elements have spilled to it. items_ and size_ cache where the
+    // elements are and how many, so that reads are as cheap as on a raw array; items_ may point
+    // into a shared heap buffer, which the non-const accessors unshare before handing it out.
+    heap_vector heap_;
+    T *items_;
+    size_t size_;
+    alignas(T) unsigned char inline_data_[N * sizeof(T)];
+
+    bool spilled() const noexcept {
+        return items_ != inline_begin();
+    }
+
+    // Refreshes the cache after heap_ has changed. A heap that gave up its block leaves the
+    // vector empty and inline again.
+    void sync_heap() noexcept {
+        if (heap_.capacity() == 0) {
+            items_ = inline_begin();
+            size_ = 0;
+        } else {
+            items_ = const_cast<T *>(heap_.cview().data());
+            size_ = heap_.size();
+        }
+    }
+
+    T *inline_begin() noexcept {
+        return std::launder(reinterpret_cast<T *>(inline_data_));
+    }
+
+    T const *inline_begin() const noexcept {
+        return std::launder(reinterpret_cast<T const *>(inline_data_));
+    }
+
+    size_t spill_capacity() const noexcept {
+        return std::max(heap_vector::next_capacity(N), heap_vector::next_capacity(0));
+    }
+
+    // Appends inline elements [first, last) to tmp_vec, moving them when that cannot throw.
+    void move_inline(heap_vector &tmp_vec, size_t first, size_t last) {
+        T *items = inline_begin();
+        for (size_t i = first; i != last; ++i) {
+            tmp_vec.push_back(std::move_if_noexcept(items[i]));
+        }
+    }
+
+    // Puts inline elements moved out by move_inline() back after a failed operation on tmp_vec.
+    void unspill(heap_vector &tmp_vec) noexcept {
+        if constexpr (std::is_nothrow_move_constructible_v<T>) {
+            T *items = inline_begin();
+            for (size_t i = 0; i != size_; ++i) {
+                items[i].~T();
+                new(items + i) T(std::move(tmp_vec[i]));
+            }
+        }
+    }
+
+    void commit_spill(heap_vector &&tmp_vec) noexcept {
+        std::destroy(inline_begin(), inline_begin() + size_);
+        heap_ = std::move(tmp_vec);
+        sync_heap();
+    }
+
+    // Constructs inline elements [first, last) at dest, moving them when that cannot throw.
+    void relocate_inline(size_t first, size_t last, T *dest) {
+        if constexpr (std::is_nothrow_move_constructible_v<T>) {
+            std::uninitialized_move(inline_begin() + first, inline_begin() + last, dest);
+        } else {
+            std::uninitialized_copy(inline_begin() + first, inline_begin() + last, dest);
+        }
+    }
+
+    // See base_vector::insert_n(). On spilling, the new elements are built before any inline
+    // element is moved, since they may be copies of them.
+    template<typename Construct>
+    T *insert_n(T const *pos, size_t count, Construct construct) {
+        size_t index = pos - cbegin();
+        if (spilled()) {
+            iterator result = heap_.insert_n(heap_.cbegin() + index, count, construct);
+            sync_heap();
+            return result;
+        }
+        if (size_ + count <= N) {
+            construct(inline_begin() + size_);
+            size_ += count;
+            std::rotate(inline_begin() + index, inline_begin() + size_ - count, inline_begin() + size_);
+            return inline_begin() + index;
+        }
+        heap_vector tmp_vec(heap_.get_allocator());
+        tmp_vec.reserve(std::max(size_ + count, spill_capacity()));
+        T *dest = tmp_vec.storage_->data_;
+        construct(dest + index);
+        try {
+            relocate_inline(0, index, dest);
+        } catch (...) {
+            std::destroy(dest + index, dest + index + count);
+            throw;
+        }
         try {
-            std::uninitialized_copy(cbegin(), cend(), new_storage_->data_);
+            relocate_inline(index, size_, dest + index + count);
         } catch (...) {
-            operator delete(new_storage_);
+            std::destroy(dest, dest + index + count);
             throw;
         }
-        new_storage_->size_ = storage_->size_;
-        new_storage_->capacity_ = storage_->capacity_;
-        new_storage_->number_of_masters_ = 1;
-        --storage_->number_of_masters_;
-        storage_ = new_storage_;
+        tmp_vec.storage_->size_ = size_ + count;
+        commit_spill(std::move(tmp_vec));
+        return items_ + index;
+    }
+
+    void destroy_all() noexcept {
+        if (!spilled()) {
+            std::destroy(inline_begin(), inline_begin() + size_);
+        }
+        heap_ = heap_vector(heap_.get_allocator());
+        items_ = inline_begin();
+        size_ = 0;
+    }
+
+    // Takes over rhs's elements; *this must be empty and not spilled.
+    void steal(small_vector &&rhs) {
+        bool rhs_spilled = rhs.spilled();
+        heap_ = std::move(rhs.heap_);
+        if (rhs_spilled) {
+            sync_heap();
+        } else {
+            std::uninitialized_move(rhs.inline_begin(), rhs.inline_begin() + rhs.size_, inline_begin());
+            size_ = rhs.size_;
+        }
+        rhs.destroy_all();
+    }
+
+    template<typename Item>
+    void resize_impl(size_t new_size, Item const &item) {
+        if (spilled()) {
+            heap_.resize(new_size, item);
+            sync_heap();
+            return;
+        }
+        if (new_size <= size_) {
+            std::destroy(inline_begin() + new_size, inline_begin() + size_);
+            size_ = new_size;
+        } else if (new_size <= N) {
+            std::uninitialized_fill_n(inline_begin() + size_, new_size - size_, item);
+            size_ = new_size;
+        } else {
+            // item may be one of the inline elements about to be moved out.
+            T copy(item);
+            heap_vector tmp_vec(heap_.get_allocator());
+            tmp_vec.reserve(new_size);
+            move_inline(tmp_vec, 0, size_);
+            try {
+                tmp_vec.resize(new_size, copy);
+            } catch (...) {
+                unspill(tmp_vec);
+                throw;
+            }
+            commit_spill(std::move(tmp_vec));
+        }
     }
 
 public:
@@ -61,109 +1781,165 @@ public:
 
     typedef T const *const_pointer;
 
-    base_vector() noexcept : storage_(nullptr) {}
+    typedef Allocator allocator_type;
+
+    small_vector() noexcept(noexcept(Allocator())) : items_(inline_begin()), size_(0) {}
+
+    explicit small_vector(Allocator const &allocator) noexcept
+            : heap_(allocator), items_(inline_begin()), size_(0) {}
+
+    small_vector(small_vector const &rhs) : heap_(rhs.heap_), items_(inline_begin()), size_(0) {
+        if (rhs.spilled()) {
+            sync_heap();
+        } else {
+            std::uninitialized_copy(rhs.inline_begin(), rhs.inline_begin() + rhs.size_, inline_begin());
+            size_ = rhs.size_;
+        }
+    }
 
-    base_vector(base_vector const &rhs) noexcept : storage_(rhs.storage_) {
-        if (storage_) {
-            ++storage_->number_of_masters_;
+    small_vector(small_vector &&rhs) noexcept(std::is_nothrow_move_constructible_v<T>)
+            : heap_(std::move(rhs.heap_)), items_(inline_begin()), size_(0) {
+        if (rhs.spilled()) {
+            sync_heap();
+        } else {
+            std::uninitialized_move(rhs.inline_begin(), rhs.inline_begin() + rhs.size_, inline_begin());
+            size_ = rhs.size_;
         }
+        rhs.destroy_all();
     }
 
-    template<typename InputIterator>
-    base_vector(InputIterator first, InputIterator last) {
-        auto count = std::distance(first, last);
-        if (count < 1) {
-            storage_ = nullptr;
+    template<typename InputIterator, typename = iterator_category_t<InputIterator>>
+    small_vector(InputIterator first, InputIterator last, Allocator const &allocator = Allocator())
+            : heap_(allocator), items_(inline_begin()), size_(0) {
+        if constexpr (is_forward_iterator_v<InputIterator>) {
+            auto count = static_cast<size_t>(std::distance(first, last));
+            if (count > N) {
+                heap_ = heap_vector(first, last, allocator);
+                sync_heap();
+            } else {
+                uninitialized_copy_counted(first, count, inline_begin());
+                size_ = count;
+            }
         } else {
-            storage_ = create_storage(count);
             try {
-                std::uninitialized_copy(first, last, storage_->data_);
+                for (; first != last; ++first) {
+                    emplace_back(*first);
+                }
             } catch (...) {
-                operator delete(storage_);
-                storage_ = nullptr;
+                destroy_all();
                 throw;
             }
-            storage_->size_ = count;
-            storage_->capacity_ = count;
-            storage_->number_of_masters_ = 1;
         }
     }
 
-    base_vector(size_t count, const_reference item) {
-        if (count < 1) {
-            storage_ = nullptr;
+    small_vector(size_t count, const_reference item, Allocator const &allocator = Allocator())
+            : heap_(allocator), items_(inline_begin()), size_(0) {
+        if (count > N) {
+            heap_ = heap_vector(count, item, allocator);
+            sync_heap();
         } else {
-            storage_ = create_storage(count);
-            try {
-                std::uninitialized_fill_n(storage_->data_, count, item);
-            } catch (...) {
-                operator delete(storage_);
-                storage_ = nullptr;
-                throw;
-            }
-            storage_->size_ = count;
-            storage_->capacity_ = count;
-            storage_->number_of_masters_ = 1;
+            std::uninitialized_fill_n(inline_begin(), count, item);
+            size_ = count;
         }
     }
 
-    base_vector &operator=(base_vector const &rhs) noexcept {
-        if (rhs.storage_ == storage_) {
+    small_vector &operator=(small_vector const &rhs) {
+        if (this == &rhs) {
             return *this;
         }
-        if (storage_) {
-            if (storage_->number_of_masters_ == 1) {
-                std::destroy(begin(), end());
-                operator delete(storage_);
-            } else {
-                --storage_->number_of_masters_;
+        if (rhs.spilled()) {
+            // Assigning the heap part directly lets equal allocators share the block.
+            bool was_inline = !spilled();
+            heap_ = rhs.heap_;
+            if (was_inline) {
+                std::destroy(inline_begin(), inline_begin() + size_);
             }
+            sync_heap();
+        } else {
+            bool propagate = std::allocator_traits<Allocator>::propagate_on_container_copy_assignment::value;
+            *this = small_vector(rhs.cbegin(), rhs.cend(), propagate ? rhs.get_allocator() : get_allocator());
         }
-        storage_ = rhs.storage_;
-        if (storage_) {
-            ++storage_->number_of_masters_;
+        return *this;
+    }
+
+    small_vector &operator=(small_vector &&rhs) noexcept(std::is_nothrow_move_constructible_v<T> &&
+                                                         std::is_nothrow_move_assignable_v<heap_vector>) {
+        if (this != &rhs) {
+            destroy_all();
+            steal(std::move(rhs));
         }
         return *this;
     }
 
-    template<typename InputIterator>
+    template<typename InputIterator, typename = iterator_category_t<InputIterator>>
     void assign(InputIterator first, InputIterator last) {
-        *this = base_vector(first, last);
+        *this = small_vector(first, last, get_allocator());
+    }
+
+    allocator_type get_allocator() const noexcept {
+        return heap_.get_allocator();
     }
 
     pointer data() {
-        broot_copy();
-        return storage_ ? storage_->data_ : nullptr;
+        // Only unsharing moves the elements; an inline vector has no heap block to share.
+        if (heap_.is_shared()) {
+            items_ = heap_.data();
+        }
+        return items_;
     }
 
     const_pointer data() const noexcept {
-        return storage_ ? storage_->data_ : nullptr;
+        return items_;
+    }
+
+    // Read-only access that leaves a shared buffer shared; the non-const accessors unshare it.
+    small_vector const &cview() const noexcept {
+        return *this;
+    }
+
+    const_span<T> as_const_span() const noexcept {
+        return const_span<T>(data(), size());
+    }
+
+    // Inline elements are hashed like a heap buffer holding them, so equal vectors hash equally.
+    size_t hash() const {
+        if (spilled()) {
+            return heap_.hash();
+        }
+        return elements_hash(items_, size_);
+    }
+
+    // Shares the heap buffer; inline elements have nothing to share and are copied.
+    vector_slice<T, Counter, Growth, Allocator> slice(size_t offset, size_t count) const {
+        if (spilled()) {
+            return heap_.slice(offset, count);
+        }
+        return vector_slice<T, Counter, Growth, Allocator>(
+                heap_vector(inline_begin() + offset, inline_begin() + offset + count, get_allocator()));
     }
 
     iterator begin() {
-        broot_copy();
-        return storage_ ? storage_->data_ : nullptr;
+        return data();
     }
 
     iterator end() {
-        broot_copy();
-        return storage_ ? storage_->data_ + storage_->size_ : nullptr;
+        return begin() + size_;
     }
 
     const_iterator begin() const noexcept {
-        return storage_ ? storage_->data_ : nullptr;
+        return items_;
     }
 
     const_iterator end() const noexcept {
-        return storage_ ? storage_->data_ + storage_->size_ : nullptr;
+        return items_ + size_;
     }
 
     const_iterator cbegin() const noexcept {
-        return storage_ ? storage_->data_ : nullptr;
+        return items_;
     }
 
     const_iterator cend() const noexcept {
-        return storage_ ? storage_->data_ + storage_->size_ : nullptr;
+        return items_ + size_;
     }
 
     reverse_iterator rbegin() {
@@ -175,458 +1951,355 @@ public:
     }
 
     const_reverse_iterator rbegin() const noexcept {
-        return std::make_reverse_iterator(cend());
+        return std::make_reverse_iterator(end());
     }
 
     const_reverse_iterator rend() const noexcept {
-        return std::make_reverse_iterator(cbegin());
+        return std::make_reverse_iterator(begin());
     }
 
     const_reverse_iterator crbegin() const noexcept {
-        return std::make_reverse_iterator(cend());
+        return std::make_reverse_iterator(end());
     }
 
     const_reverse_iterator crend() const noexcept {
-        return std::make_reverse_iterator(cbegin());
+        return std::make_reverse_iterator(begin());
     }
 
-    reference operator[](size_t pos) {
-        broot_copy();
-        return storage_->data_[pos];
+    reference operator[](size_t i) {
+        return data()[i];
     }
 
-    const_reference operator[](size_t pos) const {
-        return storage_->data_[pos];
+    const_reference operator[](size_t i) const noexcept {
+        return items_[i];
     }
 
     reference front() {
-        return operator[](0);
+        return data()[0];
     }
 
-    const_reference front() const {
-        return operator[](0);
+    const_reference front() const noexcept {
+        return items_[0];
     }
 
     reference back() {
-        return operator[](storage_->size_ - 1);
+        return data()[size_ - 1];
     }
 
-    const_reference back() const {
-        return operator[](storage_->size_ - 1);
+    const_reference back() const noexcept {
+        return items_[size_ - 1];
     }
 
     bool empty() const noexcept {
-        return storage_ ? storage_->size_ == 0 : true;
+        return size_ == 0;
     }
 
     size_t size() const noexcept {
-        return storage_ ? storage_->size_ : 0;
+        return size_;
     }
 
     size_t capacity() const noexcept {
-        return storage_ ? storage_->capacity_ : 0;
+        return spilled() ? heap_.capacity() : N;
     }
 
     void reserve(size_t new_capacity) {
-        if (new_capacity <= capacity()) {
-            return;
-        }
-        auto *new_storage_ = create_storage(new_capacity);
-        try {
-            std::uninitialized_copy(cbegin(), cend(), new_storage_->data_);
-        } catch (...) {
-            operator delete(new_storage_);
-            throw;
-        }
-        if (!storage_) {
-            new_storage_->size_ = 0;
-            new_storage_->capacity_ = new_capacity;
-            new_storage_->number_of_masters_ = 1;
-            storage_ = new_storage_;
-            return;
-        }
-        new_storage_->size_ = storage_->size_;
-        new_storage_->capacity_ = new_capacity;
-        new_storage_->number_of_masters_ = 1;
-
-        if (storage_->number_of_masters_ == 1) {
-            std::destroy(begin(), end());
-            operator delete(storage_);
-        } else {
-            --storage_->number_of_masters_;
+        if (spilled()) {
+            heap_.reserve(new_capacity);
+            sync_heap();
+        } else if (new_capacity > N) {
+            heap_vector tmp_vec(heap_.get_allocator());
+            tmp_vec.reserve(new_capacity);
+            move_inline(tmp_vec, 0, size_);
+            commit_spill(std::move(tmp_vec));
         }
-        storage_ = new_storage_;
     }
 
     void resize(size_t new_size) {
-        if (new_size == size()) {
-            return;
-        }
-        if (new_size < size()) {
-            if (storage_->number_of_masters_ > 1) {
-                auto *new_storage_ = create_storage(storage_->capacity_);
-                try {
-                    std::uninitialized_copy(cbegin(), cbegin() + new_size, new_storage_->data_);
-                } catch (...) {
-                    operator delete(new_storage_);
-                    throw;
-                }
-                new_storage_->size_ = new_size;
-                new_storage_->capacity_ = storage_->capacity_;
-                new_storage_->number_of_masters_ = 1;
-                --storage_->number_of_masters_;
-                storage_ = new_storage_;
-            } else {
-                std::destroy(begin() + new_size, end());
-                storage_->size_ = new_size;
-            }
-        } else {
-            size_t new_capacity = std::max(new_size, capacity());
-            if (!storage_ || storage_->number_of_masters_ > 1 || new_capacity > capacity()) {
-                auto *new_storage_ = create_storage(new_capacity);
-                try {
-                    std::uninitialized_copy(cbegin(), cend(), new_storage_->data_);
-                } catch (...) {
-                    operator delete(new_storage_);
-                    throw;
-                }
-                try {
-                    std::fill_n(new_storage_->data_ + size(), new_size - size(), T());
-                } catch (...) {
-                    std::destroy(new_storage_->data_, new_storage_->data_ + size());
-                    operator delete(new_storage_);
-                    throw;
-                }
-                new_storage_->size_ = new_size;
-                new_storage_->capacity_ = new_capacity;
-                new_storage_->number_of_masters_ = 1;
-                if (storage_) {
-                    if (storage_->number_of_masters_ == 1) {
-                        std::destroy(begin(), end());
-                        operator delete(storage_);
-                    } else {
-                        --storage_->number_of_masters_;
-                    }
-                }
-                storage_ = new_storage_;
-            } else {
-                std::fill_n(begin() + size(), new_size - size(), T());
-                storage_->size_ = new_size;
-            }
-        }
+        resize_impl(new_size, T());
     }
 
     void resize(size_t new_size, const_reference item) {
-        if (new_size == size()) {
-            return;
-        }
-        if (new_size < size()) {
-            if (storage_->number_of_masters_ > 1) {
-                auto *new_storage_ = create_storage(storage_->capacity_);
-                try {
-                    std::uninitialized_copy(cbegin(), cbegin() + new_size, new_storage_->data_);
-                } catch (...) {
-                    operator delete(new_storage_);
-                    throw;
-                }
-                new_storage_->size_ = new_size;
-                new_storage_->capacity_ = storage_->capacity_;
-                new_storage_->number_of_masters_ = 1;
-                --storage_->number_of_masters_;
-                storage_ = new_storage_;
-            } else {
-                std::destroy(begin() + new_size, end());
-                storage_->size_ = new_size;
-            }
-        } else {
-            size_t new_capacity = std::max(new_size, capacity());
-            if (!storage_ || storage_->number_of_masters_ > 1 || new_capacity > capacity()) {
-                auto *new_storage_ = create_storage(new_capacity);
-                try {
-                    std::uninitialized_copy(cbegin(), cend(), new_storage_->data_);
-                } catch (...) {
-                    operator delete(new_storage_);
-                    throw;
-                }
-                try {
-                    std::fill_n(new_storage_->data_ + size(), new_size - size(), item);
-                } catch (...) {
-                    std::destroy(new_storage_->data_, new_storage_->data_ + size());
-                    operator delete(new_storage_);
-                    throw;
-                }
-                new_storage_->size_ = new_size;
-                new_storage_->capacity_ = new_capacity;
-                new_storage_->number_of_masters_ = 1;
-                if (storage_) {
-                    if (storage_->number_of_masters_ == 1) {
-                        std::destroy(begin(), end());
-                        operator delete(storage_);
-                    } else {
-                        --storage_->number_of_masters_;
-                    }
-                }
-                storage_ = new_storage_;
-            } else {
-                std::fill_n(begin() + size(), new_size - size(), item);
-                storage_->size_ = new_size;
-            }
-        }
+        resize_impl(new_size, item);
     }
 
     void shrink_to_fit() {
-        if (size() == capacity()) {
-            return;
-        }
-        if (size() == 0) {
-            if (storage_->number_of_masters_ == 1) {
-                std::destroy(begin(), end());
-                operator delete(storage_);
-            } else {
-                --storage_->number_of_masters_;
-                storage_ = nullptr;
-            }
-            return;
+        if (spilled()) {
+            heap_.shrink_to_fit();
+            sync_heap();
         }
-        auto *new_storage_ = create_storage(storage_->size_);
-        try {
-            std::uninitialized_copy(cbegin(), cend(), new_storage_->data_);
-        } catch (...) {
-            operator delete(new_storage_);
-            throw;
-        }
-        new_storage_->size_ = storage_->size_;
-        new_storage_->capacity_ = storage_->size_;
-        new_storage_->number_of_masters_ = 1;
+    }
 
-        if (storage_->number_of_masters_ == 1) {
-            std::destroy(begin(), end());
-            operator delete(storage_);
+    void clear() {
+        if (spilled()) {
+            heap_.clear();
+            sync_heap();
         } else {
-            --storage_->number_of_masters_;
+            destroy_all();
         }
-        storage_ = new_storage_;
     }
 
-    void clear() {
-        resize(0);
+    template<typename... Args>
+    reference emplace_back(Args &&... args) {
+        if (spilled()) {
+            reference result = heap_.emplace_back(std::forward<Args>(args)...);
+            sync_heap();
+            return result;
+        }
+        if (size_ < N) {
+            new(inline_begin() + size_) T(std::forward<Args>(args)...);
+            return inline_begin()[size_++];
+        }
+        T item(std::forward<Args>(args)...);
+        heap_vector tmp_vec(heap_.get_allocator());
+        tmp_vec.reserve(spill_capacity());
+        move_inline(tmp_vec, 0, N);
+        tmp_vec.push_back(std::move(item));
+        commit_spill(std::move(tmp_vec));
+        return items_[size_ - 1];
     }
 
     void push_back(const_reference item) {
-        if (size() == capacity() || storage_->number_of_masters_ > 1) {
-            size_t new_capacity = (size() == capacity() ? (capacity() ? capacity() * 2 : 8) : capacity());
-            auto *new_storage_ = create_storage(new_capacity);
-            try {
-                std::uninitialized_copy(cbegin(), cend(), new_storage_->data_);
-            } catch (...) {
-                operator delete(new_storage_);
-                throw;
-            }
-            try {
-                new(new_storage_->data_ + size()) T(item);
-            } catch (...) {
-                std::destroy(new_storage_->data_, new_storage_->data_ + size());
-                operator delete(new_storage_);
-                throw;
-            }
-
-            if (!storage_) {
-                new_storage_->size_ = 1;
-                new_storage_->capacity_ = new_capacity;
-                new_storage_->number_of_masters_ = 1;
-                storage_ = new_storage_;
-                return;
-            }
-            new_storage_->size_ = storage_->size_ + 1;
-            new_storage_->capacity_ = new_capacity;
-            new_storage_->number_of_masters_ = 1;
+        emplace_back(item);
+    }
 
-            if (storage_->number_of_masters_ == 1) {
-                std::destroy(begin(), end());
-                operator delete(storage_);
-            } else {
-                --storage_->number_of_masters_;
-            }
-            storage_ = new_storage_;
-        } else {
-            try {
-                new(storage_->data_ + storage_->size_) T(item);
-                ++storage_->size_;
-            } catch (...) {
-                throw;
-            }
-        }
+    void push_back(value_type &&item) {
+        emplace_back(std::move(item));
     }
 
     void pop_back() {
-        broot_copy();
-        storage_->data_[--storage_->size_].~T();
+        if (spilled()) {
+            heap_.pop_back();
+            sync_heap();
+        } else {
+            inline_begin()[--size_].~T();
+        }
     }
 
-    iterator insert(const_iterator pos, const_reference item) {
+    template<typename... Args>
+    iterator emplace(const_iterator pos, Args &&... args) {
         size_t index = pos - cbegin();
-        if (pos == cend()) {
-            push_back(item);
-            return begin() + index;
+        if (spilled()) {
+            iterator result = heap_.emplace(heap_.cbegin() + index, std::forward<Args>(args)...);
+            sync_heap();
+            return result;
         }
-        if (size() == capacity() || storage_->number_of_masters_ > 1) {
-            size_t new_capacity = (size() == capacity() ? (capacity() ? capacity() * 2 : 8) : capacity());
-
-            auto *new_storage_ = create_storage(new_capacity);
-
-            try {
-                std::uninitialized_copy(cbegin(), pos, new_storage_->data_);
-            } catch (...) {
-                operator delete(new_storage_);
-                throw;
-            }
-            try {
-                new(new_storage_->data_ + index) T(item);
-            } catch (...) {
-                std::destroy(new_storage_->data_, new_storage_->data_ + index);
-                operator delete(new_storage_);
-                throw;
-            }
-            try {
-                std::uninitialized_copy(pos, cend(), new_storage_->data_ + index + 1);
-            } catch (...) {
-                std::destroy(new_storage_->data_, new_storage_->data_ + index + 1);
-                operator delete(new_storage_);
-                throw;
-            }
-
-            new_storage_->size_ = storage_->size_ + 1;
-            new_storage_->capacity_ = new_capacity;
-            new_storage_->number_of_masters_ = 1;
-
-            if (storage_->number_of_masters_ == 1) {
-                std::destroy(begin(), end());
-                operator delete(storage_);
-            } else {
-                --storage_->number_of_masters_;
-            }
-            storage_ = new_storage_;
-            return begin() + index;
+        if (size_ < N) {
+            new(inline_begin() + size_) T(std::forward<Args>(args)...);
+            ++size_;
+            std::rotate(inline_begin() + index, inline_begin() + size_ - 1, inline_begin() + size_);
+            return inline_begin() + index;
         }
-        std::uninitialized_copy(&item, &item + 1, end());
-        ++storage_->size_;
-        std::rotate(begin() + index, end() - 1, end());
-//        for (iterator r = end() - 1; r > begin() + index; r--) {
-//            std::iter_swap(r, r - 1);
-//        }
+        T item(std::forward<Args>(args)...);
+        heap_vector tmp_vec(heap_.get_allocator());
+        tmp_vec.reserve(spill_capacity());
+        move_inline(tmp_vec, 0, index);
+        tmp_vec.push_back(std::move(item));
+        move_inline(tmp_vec, index, N);
+        commit_spill(std::move(tmp_vec));
         return begin() + index;
     }
 
-    iterator erase(const_iterator pos) {
-        return erase(pos, pos + 1);
+    iterator insert(const_iterator pos, const_reference val) {
+        return emplace(pos, val);
     }
 
-    iterator erase(const_iterator first, const_iterator last) {
-        size_t indexl = first - cbegin();
-        size_t indexr = last - cbegin();
-        if (first == last) {
-            return begin() + indexl;
-        }
-        if (last == cend()) {
-            broot_copy();
-            std::destroy(begin() + indexl, end());
-            storage_->size_ -= (indexr - indexl);
-            return begin() + indexl;
-        }
+    iterator insert(const_iterator pos, value_type &&val) {
+        return emplace(pos, std::move(val));
+    }
 
-        if (storage_->number_of_masters_ > 1) {
-            auto *new_storage_ = create_storage(storage_->capacity_);
+    iterator insert(const_iterator pos, size_t count, const_reference val) {
+        return insert_n(pos, count, [&val, count](T *dest) {
+            uninitialized_fill_counted(dest, count, val);
+        });
+    }
 
-            try {
-                std::uninitialized_copy(cbegin(), first, new_storage_->data_);
-            } catch (...) {
-                operator delete(new_storage_);
-                throw;
-            }
-            try {
-                std::uninitialized_copy(last, cend(), new_storage_->data_ + indexl);
-            } catch (...) {
-                std::destroy(new_storage_->data_, new_storage_->data_ + indexl);
-                operator delete(new_storage_);
-                throw;
+    template<typename InputIterator, typename = iterator_category_t<InputIterator>>
+    iterator insert(const_iterator pos, InputIterator first, InputIterator last) {
+        if constexpr (is_forward_iterator_v<InputIterator>) {
+            auto count = static_cast<size_t>(std::distance(first, last));
+            return insert_n(pos, count, [first, count](T *dest) {
+                uninitialized_copy_counted(first, count, dest);
+            });
+        } else {
+            size_t index = pos - cbegin();
+            heap_vector items(heap_.get_allocator());
+            for (; first != last; ++first) {
+                items.push_back(*first);
             }
+            return insert(cbegin() + index, std::make_move_iterator(items.begin()),
+                          std::make_move_iterator(items.end()));
+        }
+    }
 
-            new_storage_->size_ = storage_->size_ - (indexr - indexl);
-            new_storage_->capacity_ = storage_->capacity_;
-            new_storage_->number_of_masters_ = 1;
+    template<typename Range>
+    void append_range(Range const &range) {
+        insert(cend(), std::begin(range), std::end(range));
+    }
 
-            if (storage_->number_of_masters_ == 1) {
-                std::destroy(begin(), end());
-                operator delete(storage_);
-            } else {
-                --storage_->number_of_masters_;
-            }
-            storage_ = new_storage_;
-            return begin() + indexl;
+    span<T> append_uninitialized(size_t count) {
+        if (spilled()) {
+            span<T> result = heap_.append_uninitialized(count);
+            sync_heap();
+            return result;
         }
-        std::move(begin() + indexr, end(), begin() + indexl);
-//        for (iterator l = begin() + indexl, r = begin() + indexr; r < end(); l++, r++) {
-//            *l = *r;
-//        }
-        std::destroy(begin() + size() - (indexr - indexl), end());
-        storage_->size_ -= (indexr - indexl);
-        return begin() + indexl;
+        return span<T>(insert_n(cend(), count, [count](T *dest) {
+            std::uninitialized_default_construct_n(dest, count);
+        }), count);
     }
 
-    friend bool operator==(base_vector const &lhs, base_vector const &rhs) {
-        if (lhs.storage_ == rhs.storage_) {
-            return true;
+    void resize_default_init(size_t new_size) {
+        if (new_size < size_) {
+            erase(cbegin() + new_size, cend());
+        } else if (new_size > size_) {
+            append_uninitialized(new_size - size_);
         }
-        return std::equal(lhs.cbegin(), lhs.cend(), rhs.cbegin(), rhs.cend());
     }
 
-    friend bool operator!=(base_vector const &lhs, base_vector const &rhs) {
-        return !(lhs == rhs);
+    iterator erase(const_iterator pos) {
+        return erase(pos, pos + 1);
     }
 
-    friend bool operator<(base_vector const &lhs, base_vector const &rhs) {
-        if (lhs.storage_ == rhs.storage_) {
+    iterator erase(const_iterator first, const_iterator last) {
+        size_t indexl = first - cbegin();
+        size_t indexr = last - cbegin();
+        if (spilled()) {
+            iterator result = heap_.erase(heap_.cbegin() + indexl, heap_.cbegin() + indexr);
+            sync_heap();
+            return result;
+        }
+        if (first != last) {
+            std::move(inline_begin() + indexr, inline_begin() + size_, inline_begin() + indexl);
+            std::destroy(inline_begin() + size_ - (indexr - indexl), inline_begin() + size_);
+            size_ -= indexr - indexl;
+        }
+        return inline_begin() + indexl;
+    }
+
+    // items_ and size_ settle identity and size for inline and heap elements alike, without
+    // looking at heap_.
+    friend bool operator==(small_vector const &lhs, small_vector const &rhs) {
+        if (lhs.size_ != rhs.size_) {
             return false;
         }
-        return std::lexicographical_compare(lhs.begin(), lhs.end(), rhs.begin(), rhs.end());
+        if (lhs.items_ == rhs.items_) {
+            return true;
+        }
+        if (lhs.spilled() && rhs.spilled()) {
+            return lhs.heap_ == rhs.heap_;
+        }
+        return elements_equal(lhs.items_, lhs.size_, rhs.items_, rhs.size_);
     }
 
-    friend bool operator>(base_vector const &lhs, base_vector const &rhs) {
+    friend bool operator!=(small_vector const &lhs, small_vector const &rhs) {
+        return !(lhs == rhs);
+    }
+
+    friend bool operator<(small_vector const &lhs, small_vector const &rhs) {
+        return elements_less(lhs.items_, lhs.size_, rhs.items_, rhs.size_);
+    }
+
+    friend bool operator>(small_vector const &lhs, small_vector const &rhs) {
         return rhs < lhs;
     }
 
-    friend bool operator<=(base_vector const &lhs, base_vector const &rhs) {
+    friend bool operator<=(small_vector const &lhs, small_vector const &rhs) {
         return !(lhs > rhs);
     }
 
-    friend bool operator>=(base_vector const &lhs, base_vector const &rhs) {
+    friend bool operator>=(small_vector const &lhs, small_vector const &rhs) {
         return !(lhs < rhs);
     }
 
-    friend void swap(base_vector &lhs, base_vector &rhs) noexcept {
-        std::swap(lhs.storage_, rhs.storage_);
+    friend void swap(small_vector &lhs, small_vector &rhs) {
+        if (&lhs == &rhs) {
+            return;
+        }
+        if (lhs.spilled() && rhs.spilled()) {
+            swap(lhs.heap_, rhs.heap_);
+            lhs.sync_heap();
+            rhs.sync_heap();
+            return;
+        }
+        small_vector tmp(std::move(lhs));
+        lhs = std::move(rhs);
+        rhs = std::move(tmp);
     }
 
-    ~base_vector() {
-        if (storage_) {
-            if (storage_->number_of_masters_ == 1) {
-                std::destroy(begin(), end());
-                operator delete(storage_);
-            } else {
-                --storage_->number_of_masters_;
-            }
+    ~small_vector() {
+        if (!spilled()) {
+            std::destroy(inline_begin(), inline_begin() + size_);
         }
     }
 };
 
-template<typename T>
-class vector {
-    std::variant<std::monostate, T, base_vector<T>> data_;
+// Without inline room a small_vector is just its heap vector: a single pointer.
+template<typename T, typename Counter, typename Growth, typename Allocator>
+class small_vector<T, 0, Counter, Growth, Allocator> : public base_vector<T, Counter, Growth, Allocator> {
+public:
+    using base_vector<T, Counter, Growth, Allocator>::base_vector;
+
+    small_vector() = default;
+
+    small_vector(base_vector<T, Counter, Growth, Allocator> const &rhs) : base_vector<T, Counter, Growth, Allocator>(rhs) {}
+
+    small_vector(base_vector<T, Counter, Growth, Allocator> &&rhs) noexcept
+            : base_vector<T, Counter, Growth, Allocator>(std::move(rhs)) {}
+};
+
+// A base_vector whose non-const accessors hand out proxies instead of T&, so a shared buffer
+// is copied when an element is assigned through one, not when it is merely looked up.
+template<typename T, typename Counter = plain_counter, typename Growth = doubling_growth,
+        typename Allocator = std::allocator<T>>
+class cow_vector {
+    typedef base_vector<T, Counter, Growth, Allocator> heap_vector;
+
+    heap_vector items_;
 
 public:
-    typedef T value_type;
+    class iterator;
 
-    typedef T *iterator;
+    // Reads see the current buffer; assignment unshares it first.
+    class reference {
+        friend class cow_vector;
+
+        cow_vector *owner_;
+        size_t index_;
+
+        reference(cow_vector *owner, size_t index) noexcept : owner_(owner), index_(index) {}
+
+    public:
+        reference(reference const &other) noexcept = default;
+
+        T const &get() const noexcept {
+            return owner_->items_.cview()[index_];
+        }
+
+        operator T const &() const noexcept {
+            return get();
+        }
+
+        reference &operator=(T const &value) {
+            owner_->items_[index_] = value;
+            return *this;
+        }
+
+        reference &operator=(T &&value) {
+            owner_->items_[index_] = std::move(value);
+            return *this;
+        }
+
+        reference &operator=(reference const &other) {
+            return *this = other.get();
+        }
+
+        friend void swap(reference lhs, reference rhs) {
+            T tmp(lhs.get());
+            lhs = rhs.get();
+            rhs = std::move(tmp);
+        }
+    };
+
+    typedef T value_type;
 
     typedef T const *const_iterator;
 
@@ -634,273 +2307,295 @@ public:
 
     typedef std::reverse_iterator<const_iterator> const_reverse_iterator;
 
-    typedef T &reference;
-
     typedef T const &const_reference;
 
-    typedef T *pointer;
-
     typedef T const *const_pointer;
 
-    vector() noexcept = default;
+    typedef Allocator allocator_type;
+
+    // Keeps an index rather than a pointer, so it stays valid when a write moves the buffer.
+    class iterator {
+        friend class cow_vector;
+
+        cow_vector *owner_;
+        size_t index_;
+
+        iterator(cow_vector *owner, size_t index) noexcept : owner_(owner), index_(index) {}
+
+    public:
+        typedef std::random_access_iterator_tag iterator_category;
 
-    vector(vector const &rhs) = default;
+        typedef T value_type;
 
-    template<typename InputIterator>
-    vector(InputIterator first, InputIterator last) {
-        if (last - first == 1) {
-            data_ = T(*first);
-        } else if (last - first > 1) {
-            data_ = base_vector(first, last);
+        typedef std::ptrdiff_t difference_type;
+
+        typedef T const *pointer;
+
+        typedef cow_vector::reference reference;
+
+        iterator() noexcept : owner_(nullptr), index_(0) {}
+
+        operator const_iterator() const noexcept {
+            return owner_->items_.cbegin() + index_;
         }
-    }
 
-    vector &operator=(vector const &rhs) = default;
+        reference operator*() const noexcept {
+            return reference(owner_, index_);
+        }
+
+        pointer operator->() const noexcept {
+            return &owner_->items_.cview()[index_];
+        }
+
+        reference operator[](difference_type n) const noexcept {
+            return reference(owner_, index_ + n);
+        }
+
+        iterator &operator++() noexcept {
+            ++index_;
+            return *this;
+        }
+
+        iterator operator++(int) noexcept {
+            iterator result = *this;
+            ++index_;
+            return result;
+        }
+
+        iterator &operator--() noexcept {
+            --index_;
+            return *this;
+        }
+
+        iterator operator--(int) noexcept {
+            iterator result = *this;
+            --index_;
+            return result;
+        }
+
+        iterator &operator+=(difference_type n) noexcept {
+            index_ += n;
+            return *this;
+        }
+
+        iterator &operator-=(difference_type n) noexcept {
+            index_ -= n;
+            return *this;
+        }
+
+        friend iterator operator+(iterator it, difference_type n) noexcept {
+            return it += n;
+        }
+
+        friend iterator operator+(difference_type n, iterator it) noexcept {
+            return it += n;
+        }
+
+        friend iterator operator-(iterator it, difference_type n) noexcept {
+            return it -= n;
+        }
+
+        friend difference_type operator-(iterator const &lhs, iterator const &rhs) noexcept {
+            return static_cast<difference_type>(lhs.index_) - static_cast<difference_type>(rhs.index_);
+        }
+
+        friend bool operator==(iterator const &lhs, iterator const &rhs) noexcept {
+            return lhs.index_ == rhs.index_;
+        }
+
+        friend bool operator!=(iterator const &lhs, iterator const &rhs) noexcept {
+            return lhs.index_ != rhs.index_;
+        }
+
+        friend bool operator<(iterator const &lhs, iterator const &rhs) noexcept {
+            return lhs.index_ < rhs.index_;
+        }
+
+        friend bool operator>(iterator const &lhs, iterator const &rhs) noexcept {
+            return lhs.index_ > rhs.index_;
+        }
+
+        friend bool operator<=(iterator const &lhs, iterator const &rhs) noexcept {
+            return lhs.index_ <= rhs.index_;
+        }
+
+        friend bool operator>=(iterator const &lhs, iterator const &rhs) noexcept {
+            return lhs.index_ >= rhs.index_;
+        }
+    };
+
+    cow_vector() noexcept(noexcept(Allocator())) = default;
 
-    template<typename InputIterator>
+    explicit cow_vector(Allocator const &allocator) noexcept : items_(allocator) {}
+
+    template<typename InputIterator, typename = iterator_category_t<InputIterator>>
+    cow_vector(InputIterator first, InputIterator last, Allocator const &allocator = Allocator())
+            : items_(first, last, allocator) {}
+
+    cow_vector(size_t count, const_reference item, Allocator const &allocator = Allocator())
+            : items_(count, item, allocator) {}
+
+    template<typename InputIterator, typename = iterator_category_t<InputIterator>>
     void assign(InputIterator first, InputIterator last) {
-        *this = vector(first, last);
+        items_.assign(first, last);
     }
 
-    pointer data() {
-        if (data_.index() == 0) {
-            return nullptr;
-        } else if (data_.index() == 1) {
-            return &std::get<1>(data_);
-        }
-        return std::get<2>(data_).data();
+    allocator_type get_allocator() const noexcept {
+        return items_.get_allocator();
     }
 
+    // There is no mutable data(): a raw pointer cannot tell reads from writes.
     const_pointer data() const noexcept {
-        if (data_.index() == 0) {
-            return nullptr;
-        } else if (data_.index() == 1) {
-            return &std::get<1>(data_);
-        }
-        return std::get<2>(data_).data();
+        return items_.data();
     }
 
-    iterator begin() {
-        return data();
+    cow_vector const &cview() const noexcept {
+        return *this;
     }
 
-    iterator end() {
-        return begin() + size();
+    const_span<T> as_const_span() const noexcept {
+        return items_.as_const_span();
+    }
+
+    size_t hash() const {
+        return items_.hash();
+    }
+
+    iterator begin() noexcept {
+        return iterator(this, 0);
+    }
+
+    iterator end() noexcept {
+        return iterator(this, size());
     }
 
     const_iterator begin() const noexcept {
-        return data();
+        return items_.cbegin();
     }
 
     const_iterator end() const noexcept {
-        return begin() + size();
+        return items_.cend();
     }
 
     const_iterator cbegin() const noexcept {
-        return data();
+        return items_.cbegin();
     }
 
     const_iterator cend() const noexcept {
-        return begin() + size();
+        return items_.cend();
     }
 
-    reverse_iterator rbegin() {
+    reverse_iterator rbegin() noexcept {
         return std::make_reverse_iterator(end());
     }
 
-    reverse_iterator rend() {
+    reverse_iterator rend() noexcept {
         return std::make_reverse_iterator(begin());
     }
 
     const_reverse_iterator rbegin() const noexcept {
-        return std::make_reverse_iterator(end());
+        return std::make_reverse_iterator(cend());
     }
 
     const_reverse_iterator rend() const noexcept {
-        return std::make_reverse_iterator(begin());
+        return std::make_reverse_iterator(cbegin());
     }
 
     const_reverse_iterator crbegin() const noexcept {
-        return std::make_reverse_iterator(end());
+        return std::make_reverse_iterator(cend());
     }
 
     const_reverse_iterator crend() const noexcept {
-        return std::make_reverse_iterator(begin());
+        return std::make_reverse_iterator(cbegin());
     }
 
-    reference operator[](size_t i) {
-        if (data_.index() == 1) { return std::get<1>(data_); }
-        return std::get<2>(data_)[i];
+    reference operator[](size_t i) noexcept {
+        return reference(this, i);
     }
 
     const_reference operator[](size_t i) const noexcept {
-        if (data_.index() == 1) { return std::get<1>(data_); }
-        return std::get<2>(data_)[i];
+        return items_[i];
     }
 
-    reference front() {
-        if (data_.index() == 1) { return std::get<1>(data_); }
-        return std::get<2>(data_).front();
+    reference front() noexcept {
+        return reference(this, 0);
     }
 
     const_reference front() const noexcept {
-        if (data_.index() == 1) { return std::get<1>(data_); }
-        return std::get<2>(data_).front();
+        return items_.front();
     }
 
-    reference back() {
-        if (data_.index() == 1) { return std::get<1>(data_); }
-        return std::get<2>(data_).back();
+    reference back() noexcept {
+        return reference(this, size() - 1);
     }
 
     const_reference back() const noexcept {
-        if (data_.index() == 1) { return std::get<1>(data_); }
-        return std::get<2>(data_).back();
+        return items_.back();
     }
 
     bool empty() const noexcept {
-        return size() == 0;
+        return items_.empty();
     }
 
     size_t size() const noexcept {
-        if (data_.index() == 0) {
-            return 0;
-        } else if (data_.index() == 1) {
-            return 1;
-        }
-        return std::get<2>(data_).size();
+        return items_.size();
     }
 
     size_t capacity() const noexcept {
-        if (data_.index() == 0) {
-            return 0;
-        } else if (data_.index() == 1) {
-            return 1;
-        }
-        std::get<2>(data_).capacity();
+        return items_.capacity();
     }
 
     void reserve(size_t new_capacity) {
-        base_vector<T> tmp_vec;
-        if (data_.index() == 0) {
-            if (new_capacity == 0) {
-                return;
-            }
-        } else if (data_.index() == 1) {
-            if (new_capacity < 2) {
-                return;
-            }
-            tmp_vec.push_back(std::get<1>(data_));
-        } else {
-            std::get<2>(data_).reserve(new_capacity);
-            return;
-        }
-        tmp_vec.reserve(new_capacity);
-        data_ = tmp_vec;
+        items_.reserve(new_capacity);
     }
 
     void resize(size_t new_size) {
-        base_vector<T> tmp_vec;
-        if (data_.index() == 0) {
-            if (new_size == 0) {
-                return;
-            }
-            if (new_size == 1) {
-                data_ = T();
-                return;
-            }
-        } else if (data_.index() == 1) {
-            if (new_size == 0) {
-                data_ = std::monostate();
-                return;
-            }
-            if (new_size == 1) {
-                return;
-            }
-            tmp_vec.push_back(std::get<1>(data_));
-        } else {
-            std::get<2>(data_).resize(new_size);
-            return;
-        }
-        tmp_vec.resize(new_size);
-        data_ = tmp_vec;
+        items_.resize(new_size);
     }
 
     void resize(size_t new_size, const_reference item) {
-        base_vector<T> tmp_vec;
-        if (data_.index() == 0) {
-            if (new_size == 0) {
-                return;
-            }
-            if (new_size == 1) {
-                data_ = T(item);
-                return;
-            }
-        } else if (data_.index() == 1) {
-            if (new_size == 0) {
-                data_ = std::monostate();
-                return;
-            }
-            if (new_size == 1) {
-                return;
-            }
-            tmp_vec.push_back(std::get<1>(data_));
-        } else {
-            std::get<2>(data_).resize(new_size, item);
-            return;
-        }
-        tmp_vec.resize(new_size, item);
-        data_ = tmp_vec;
+        items_.resize(new_size, item);
     }
 
     void shrink_to_fit() {
-        if (data_.index() == 2) {
-            std::get<2>(data_).shrink_to_fit();
-        }
+        items_.shrink_to_fit();
     }
 
     void clear() {
-        if (data_.index() == 2) {
-            std::get<2>(data_).clear();
-        } else {
-            data_ = std::monostate();
-        }
+        items_.clear();
+    }
+
+    template<typename... Args>
+    reference emplace_back(Args &&... args) {
+        items_.emplace_back(std::forward<Args>(args)...);
+        return back();
     }
 
     void push_back(const_reference item) {
-        if (data_.index() == 0) {
-            data_ = T(item);
-        } else if (data_.index() == 1) {
-            base_vector<T> tmp_vec;
-            tmp_vec.push_back(std::get<1>(data_));
-            tmp_vec.push_back(item);
-            data_ = tmp_vec;
-        } else {
-            std::get<2>(data_).push_back(item);
-        }
+        items_.push_back(item);
+    }
+
+    void push_back(value_type &&item) {
+        items_.push_back(std::move(item));
     }
 
     void pop_back() {
-        if (data_.index() == 1) {
-            data_ = std::monostate();
-        } else {
-            std::get<2>(data_).pop_back();
-        }
+        items_.pop_back();
     }
 
-    iterator insert(const_iterator pos, const_reference val) {
-        base_vector<T> tmp_vec;
+    template<typename... Args>
+    iterator emplace(const_iterator pos, Args &&... args) {
         size_t index = pos - cbegin();
-        if (data_.index() == 0) {
-            data_ = T(val);
-            return begin();
-        } else if (data_.index() == 1) {
-            tmp_vec.push_back(std::get<1>(data_));
-            tmp_vec.insert(tmp_vec.cbegin() + index, val);
-            data_ = tmp_vec;
-            return begin() + index;
-        }
-        return std::get<2>(data_).insert(begin() + index, val);
+        items_.emplace(pos, std::forward<Args>(args)...);
+        return iterator(this, index);
+    }
+
+    iterator insert(const_iterator pos, const_reference item) {
+        return emplace(pos, item);
+    }
+
+    iterator insert(const_iterator pos, value_type &&item) {
+        return emplace(pos, std::move(item));
     }
 
     iterator erase(const_iterator pos) {
@@ -908,46 +2603,132 @@ public:
     }
 
     iterator erase(const_iterator first, const_iterator last) {
-        if (last == first) {
-            return begin() + (first - cbegin());
-        }
-        if (data_.index() == 1) {
-            data_ = std::monostate();
-            return begin();
-        }
-        return std::get<2>(data_).erase(first, last);
+        size_t index = first - cbegin();
+        items_.erase(first, last);
+        return iterator(this, index);
     }
 
-    friend bool operator==(vector const &lhs, vector const &rhs) {
-        if (lhs.data_.index() == 2 && rhs.data_.index() == 2) {
-            return std::get<2>(lhs.data_) == std::get<2>(rhs.data_);
-        }
-        return std::equal(lhs.cbegin(), lhs.cend(), rhs.cbegin(), rhs.cend());
+    friend bool operator==(cow_vector const &lhs, cow_vector const &rhs) {
+        return lhs.items_ == rhs.items_;
     }
 
-    friend bool operator!=(vector const &lhs, vector const &rhs) {
-        return !(lhs == rhs);
+    friend bool operator!=(cow_vector const &lhs, cow_vector const &rhs) {
+        return lhs.items_ != rhs.items_;
     }
 
-    friend bool operator<(vector const &lhs, vector const &rhs) {
-        return std::lexicographical_compare(lhs.cbegin(), lhs.cend(), rhs.cbegin(), rhs.cend());
+    friend bool operator<(cow_vector const &lhs, cow_vector const &rhs) {
+        return lhs.items_ < rhs.items_;
     }
 
-    friend bool operator>(vector const &lhs, vector const &rhs) {
-        return rhs < lhs;
+    friend bool operator>(cow_vector const &lhs, cow_vector const &rhs) {
+        return lhs.items_ > rhs.items_;
     }
 
-    friend bool operator<=(vector const &lhs, vector const &rhs) {
-        return !(lhs > rhs);
+    friend bool operator<=(cow_vector const &lhs, cow_vector const &rhs) {
+        return lhs.items_ <= rhs.items_;
     }
 
-    friend bool operator>=(vector const &lhs, vector const &rhs) {
-        return !(lhs < rhs);
+    friend bool operator>=(cow_vector const &lhs, cow_vector const &rhs) {
+        return lhs.items_ >= rhs.items_;
     }
 
-    friend void swap(vector &lhs, vector &rhs) {
-        std::swap(lhs.data_, rhs.data_);
+    friend void swap(cow_vector &lhs, cow_vector &rhs) noexcept {
+        swap(lhs.items_, rhs.items_);
     }
 };
 
+// Elements up to this size are kept inline in vector<T>. A bigger one would make every empty
+// vector as big as the element, so those vectors are a single pointer instead.
+inline constexpr size_t vector_inline_limit = 16;
+
+template<typename T>
+inline constexpr size_t vector_inline_capacity = sizeof(T) <= vector_inline_limit ? 1 : 0;
+
+// The general-purpose vector keeps a single small element inline before spilling to a shared heap buffer.
+template<typename T, typename Counter = plain_counter, typename Growth = doubling_growth,
+        typename Allocator = std::allocator<T>>
+using vector = small_vector<T, vector_inline_capacity<T>, Counter, Growth, Allocator>;
+
+// Size report for vector<T>; naming vector_layout<T>::bytes checks the layout at compile time.
+template<typename T>
+struct vector_layout {
+    static constexpr size_t inline_capacity = vector_inline_capacity<T>;
+
+    static constexpr size_t bytes = sizeof(vector<T>);
+
+    // heap_, items_ and size_, then the inline slot at T's alignment, padded to the alignment
+    // of the whole; alignment is all an over-aligned element adds to its own size. The cached
+    // items_ and size_ are two of those words: vector<int> is 32 bytes on 64-bit targets, where
+    // a heap pointer and the inline slot alone would take 16.
+    static constexpr size_t inline_bound() noexcept {
+        size_t align = std::max(alignof(T), alignof(void *));
+        size_t slot = (2 * sizeof(void *) + sizeof(size_t) + alignof(T) - 1) / alignof(T) * alignof(T);
+        return (slot + inline_capacity * sizeof(T) + align - 1) / align * align;
+    }
+
+    static_assert(inline_capacity != 0 || bytes == sizeof(void *), "a vector of large elements is one pointer");
+    static_assert(inline_capacity == 0 || bytes == inline_bound(),
+                  "an inline element costs no more than its own size and alignment");
+};
+
+// Copies of a shared_vector may be handed to and destroyed by different threads.
+template<typename T>
+using shared_vector = vector<T, atomic_counter>;
+
+namespace pmr {
+    template<typename T, typename Counter = plain_counter, typename Growth = doubling_growth>
+    using base_vector = ::base_vector<T, Counter, Growth, std::pmr::polymorphic_allocator<T>>;
+
+    template<typename T, size_t N, typename Counter = plain_counter, typename Growth = doubling_growth>
+    using small_vector = ::small_vector<T, N, Counter, Growth, std::pmr::polymorphic_allocator<T>>;
+
+    template<typename T, typename Counter = plain_counter, typename Growth = doubling_growth>
+    using vector = ::vector<T, Counter, Growth, std::pmr::polymorphic_allocator<T>>;
+
+    template<typename T, typename Counter = plain_counter, typename Growth = doubling_growth>
+    using cow_vector = ::cow_vector<T, Counter, Growth, std::pmr::polymorphic_allocator<T>>;
+
+    // Monotonic arena for vectors that all die together, e.g. at the end of a request. The first
+    // Bytes are carved out of the arena object itself, later chunks come from upstream, and
+    // deallocation is a no-op until the arena is destroyed.
+    template<size_t Bytes>
+    class request_arena : public std::pmr::monotonic_buffer_resource {
+        alignas(std::max_align_t) unsigned char buffer_[Bytes];
+
+    public:
+        explicit request_arena(std::pmr::memory_resource *upstream = std::pmr::get_default_resource())
+                : std::pmr::monotonic_buffer_resource(buffer_, Bytes, upstream) {}
+    };
+}
+
+namespace std {
+    template<typename T, typename Counter, typename Growth, typename Allocator>
+    struct hash<base_vector<T, Counter, Growth, Allocator>> {
+        size_t operator()(base_vector<T, Counter, Growth, Allocator> const &items) const {
+            return items.hash();
+        }
+    };
+
+    template<typename T, size_t N, typename Counter, typename Growth, typename Allocator>
+    struct hash<small_vector<T, N, Counter, Growth, Allocator>> {
+        size_t operator()(small_vector<T, N, Counter, Growth, Allocator> const &items) const {
+            return items.hash();
+        }
+    };
+
+    template<typename T, typename Counter, typename Growth, typename Allocator>
+    struct hash<vector_slice<T, Counter, Growth, Allocator>> {
+        size_t operator()(vector_slice<T, Counter, Growth, Allocator> const &items) const {
+            return items.hash();
+        }
+    };
+
+    template<typename T, typename Counter, typename Growth, typename Allocator>
+    struct hash<cow_vector<T, Counter, Growth, Allocator>> {
+        size_t operator()(cow_vector<T, Counter, Growth, Allocator> const &items) const {
+            return items.hash();
+        }
+    };
+}
+
 #endif //VECTOR_VECTOR_H
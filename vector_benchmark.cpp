@@ -0,0 +1,604 @@
+#include <gtest/gtest.h>
+#include "fault_injection.h"
+#include "vector.h"
+#include "persistent_vector.h"
+
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <string_view>
+#include <thread>
+
+// A trivially copyable element that opts in to parallel bulk copies.
+struct parallel_int {
+    int value;
+};
+
+template<>
+struct is_parallel_copyable<parallel_int> : std::true_type {};
+
+namespace {
+    typedef std::chrono::steady_clock benchmark_clock;
+
+    double seconds_since(benchmark_clock::time_point start) {
+        return std::chrono::duration<double>(benchmark_clock::now() - start).count();
+    }
+
+    template<typename Vector>
+    Vector make_sequence(size_t count) {
+        Vector result;
+        for (size_t i = 0; i != count; ++i) {
+            result.push_back(static_cast<int>(i));
+        }
+        return result;
+    }
+
+    template<typename Vector>
+    double copy_destroy_throughput(Vector const &snapshot, size_t threads, size_t copies_per_thread) {
+        std::vector<std::thread> workers;
+        std::atomic<size_t> copied_elements(0);
+        auto start = benchmark_clock::now();
+        for (size_t t = 0; t != threads; ++t) {
+            workers.emplace_back([&snapshot, &copied_elements, copies_per_thread] {
+                size_t sum = 0;
+                for (size_t i = 0; i != copies_per_thread; ++i) {
+                    Vector copy = snapshot;
+                    sum += copy.size();
+                }
+                copied_elements += sum;
+            });
+        }
+        for (auto &worker : workers) {
+            worker.join();
+        }
+        EXPECT_EQ(threads * copies_per_thread * snapshot.size(), copied_elements.load());
+        return static_cast<double>(threads * copies_per_thread) / seconds_since(start);
+    }
+
+    // Not trivially copyable, so its buffers come from the counting operator new.
+    struct record {
+        record(int key) : key(key) {}
+        record(record const &other) : key(other.key) {}
+        record &operator=(record const &other) = default;
+
+        int key;
+    };
+
+    size_t live_heap_bytes = 0;
+
+    // Counts the bytes of every live block, header and slack included.
+    template<typename T>
+    struct counting_allocator {
+        typedef T value_type;
+
+        counting_allocator() = default;
+
+        template<typename U>
+        counting_allocator(counting_allocator<U> const &) {}
+
+        T *allocate(size_t n) {
+            live_heap_bytes += n * sizeof(T);
+            return std::allocator<T>().allocate(n);
+        }
+
+        void deallocate(T *p, size_t n) {
+            live_heap_bytes -= n * sizeof(T);
+            std::allocator<T>().deallocate(p, n);
+        }
+
+        friend bool operator==(counting_allocator const &, counting_allocator const &) { return true; }
+        friend bool operator!=(counting_allocator const &, counting_allocator const &) { return false; }
+    };
+
+    template<size_t N>
+    void inline_capacity_row(size_t items_per_vector) {
+        size_t const vectors = 100000;
+        std::vector<small_vector<record, N>> batch(vectors);
+
+        size_t allocations_before = allocations_on_this_thread();
+        auto start = benchmark_clock::now();
+        for (auto &v : batch) {
+            for (size_t i = 0; i != items_per_vector; ++i) {
+                v.push_back(static_cast<int>(i));
+            }
+        }
+        double push_ns = seconds_since(start) * 1e9 / (vectors * items_per_vector);
+        size_t allocations = allocations_on_this_thread() - allocations_before;
+
+        long long sum = 0;
+        start = benchmark_clock::now();
+        for (auto const &v : batch) {
+            for (auto const &item : v) {
+                sum += item.key;
+            }
+        }
+        double iterate_ns = seconds_since(start) * 1e9 / (vectors * items_per_vector);
+        EXPECT_EQ(static_cast<long long>(vectors * items_per_vector * (items_per_vector - 1) / 2), sum);
+
+        std::cout << std::setw(4) << N << std::setw(7) << items_per_vector
+                  << std::setw(13) << static_cast<double>(allocations) / vectors
+                  << std::setw(12) << push_ns << std::setw(12) << iterate_ns << '\n';
+    }
+
+    template<typename Growth>
+    void growth_policy_row(char const *name, size_t elements) {
+        base_vector<record, plain_counter, Growth> v;
+        size_t reallocations = 0;
+        size_t peak_elements = 0;
+        size_t allocations_before = allocations_on_this_thread();
+        auto start = benchmark_clock::now();
+        for (size_t i = 0; i != elements; ++i) {
+            size_t old_capacity = v.capacity();
+            v.push_back(static_cast<int>(i));
+            if (v.capacity() != old_capacity) {
+                ++reallocations;
+                // Both blocks are alive while the elements are relocated.
+                peak_elements = std::max(peak_elements, old_capacity + v.capacity());
+            }
+        }
+        double push_ns = seconds_since(start) * 1e9 / elements;
+        EXPECT_EQ(reallocations, allocations_on_this_thread() - allocations_before);
+
+        std::cout << std::setw(22) << name << std::setw(10) << elements << std::setw(8) << reallocations
+                  << std::setw(12) << peak_elements * sizeof(record) / 1024
+                  << std::setw(12) << v.capacity() * sizeof(record) / 1024
+                  << std::setw(9) << 100.0 * (v.capacity() - v.size()) / v.capacity()
+                  << std::setw(10) << push_ns << '\n';
+    }
+
+    // One request builds `vectors` short vectors of records and drops them all at the end.
+    template<typename Vector, typename MakeVector>
+    void request_row(char const *name, MakeVector make_vector) {
+        size_t const requests = 200;
+        size_t const vectors = 1000;
+        size_t const items_per_vector = 12;
+        std::vector<Vector> pool;
+        pool.reserve(vectors);
+
+        size_t allocations_before = allocations_on_this_thread();
+        auto start = benchmark_clock::now();
+        for (size_t r = 0; r != requests; ++r) {
+            pmr::request_arena<64 * 1024> arena;
+            for (size_t v = 0; v != vectors; ++v) {
+                pool.push_back(make_vector(arena));
+                for (size_t i = 0; i != items_per_vector; ++i) {
+                    pool.back().push_back(static_cast<int>(i));
+                }
+            }
+            EXPECT_EQ(items_per_vector, pool.back().size());
+            pool.clear();
+        }
+        double request_us = seconds_since(start) * 1e6 / requests;
+        size_t allocations = allocations_on_this_thread() - allocations_before;
+
+        std::cout << std::setw(20) << name << std::setw(12) << request_us
+                  << std::setw(14) << static_cast<double>(allocations) / requests << '\n';
+    }
+
+    // Ten million vectors of three elements each, as an index of short posting lists would hold.
+    template<typename T, typename Counter>
+    void header_row(char const *name) {
+        typedef base_vector<T, Counter, doubling_growth, counting_allocator<T>> heap_vector;
+        size_t const vectors = 10000000;
+        size_t const items_per_vector = 3;
+        std::vector<heap_vector> index;
+        index.reserve(vectors);
+
+        auto start = benchmark_clock::now();
+        for (size_t v = 0; v != vectors; ++v) {
+            index.emplace_back(items_per_vector, static_cast<T>(v));
+        }
+        double build_ns = seconds_since(start) * 1e9 / vectors;
+        size_t bytes = live_heap_bytes;
+        EXPECT_EQ(static_cast<T>(vectors - 1), index.back()[items_per_vector - 1]);
+        index.clear();
+        EXPECT_EQ(0u, live_heap_bytes);
+
+        std::cout << std::setw(24) << name << std::setw(12) << static_cast<double>(bytes) / vectors
+                  << std::setw(10) << bytes / (1024 * 1024) << std::setw(12) << build_ns << '\n';
+    }
+
+    // Each reader takes a copy of the snapshot and looks elements up through the non-const
+    // operator[]; one reader in a hundred also writes.
+    template<typename Vector, typename Read>
+    void snapshot_reader_row(char const *name, Read read) {
+        size_t const readers = 2000;
+        size_t const reads_per_reader = 1000;
+        Vector snapshot;
+        for (int i = 0; i != 100000; ++i) {
+            snapshot.push_back(i);
+        }
+
+        long long sum = 0;
+        size_t allocations_before = allocations_on_this_thread();
+        auto start = benchmark_clock::now();
+        for (size_t r = 0; r != readers; ++r) {
+            Vector copy = snapshot;
+            for (size_t i = 0; i != reads_per_reader; ++i) {
+                sum += read(copy[(r * 7919 + i * 104729) % copy.size()]);
+            }
+            if (r % 100 == 0) {
+                copy[r] = -1;
+            }
+        }
+        double reader_us = seconds_since(start) * 1e6 / readers;
+        size_t allocations = allocations_on_this_thread() - allocations_before;
+        EXPECT_NE(0, sum);
+
+        std::cout << std::setw(12) << name << std::setw(12) << reader_us
+                  << std::setw(14) << static_cast<double>(allocations) / readers << '\n';
+    }
+
+    // Copies a large snapshot and writes one element of the copy, as an editor keeping an undo
+    // history would; then scans the copy once.
+    template<typename Vector>
+    void snapshot_write_row(char const *name, size_t elements) {
+        size_t const writes = 200;
+        Vector snapshot;
+        for (size_t i = 0; i != elements; ++i) {
+            snapshot.push_back(static_cast<int>(i));
+        }
+
+        auto start = benchmark_clock::now();
+        for (size_t w = 0; w != writes; ++w) {
+            Vector copy = snapshot;
+            copy[w * 7919 % elements] = -1;
+        }
+        double write_us = seconds_since(start) * 1e6 / writes;
+
+        Vector const &view = snapshot;
+        long long sum = 0;
+        start = benchmark_clock::now();
+        for (auto item : view) {
+            sum += item;
+        }
+        double scan_ns = seconds_since(start) * 1e9 / elements;
+        EXPECT_EQ(static_cast<long long>(elements * (elements - 1) / 2), sum);
+
+        std::cout << std::setw(18) << name << std::setw(10) << elements
+                  << std::setw(14) << write_us << std::setw(12) << scan_ns << '\n';
+    }
+
+    // Sums 10^7 elements by index, the loop shape that should compile to plain array code.
+    template<typename Vector>
+    void indexed_sum_row(char const *name, Vector &v) {
+        size_t const passes = 10;
+        long long sum = 0;
+        auto start = benchmark_clock::now();
+        for (size_t p = 0; p != passes; ++p) {
+            for (size_t i = 0; i != v.size(); ++i) {
+                sum += v[i];
+            }
+        }
+        double sum_ns = seconds_since(start) * 1e9 / (passes * v.size());
+        EXPECT_EQ(static_cast<long long>(passes * v.size() * (v.size() - 1) / 2), sum);
+
+        std::cout << std::setw(18) << name << std::setw(12) << sum_ns << '\n';
+    }
+
+    // Concatenates 1000 vectors of part_size records into one, the way append says.
+    template<typename Vector, typename Append>
+    void concat_row(char const *name, size_t part_size, Append append) {
+        size_t const parts_count = 1000;
+        size_t const passes = 20;
+        std::vector<Vector> parts;
+        for (size_t i = 0; i != parts_count; ++i) {
+            parts.push_back(make_sequence<Vector>(part_size));
+        }
+
+        size_t total = 0;
+        size_t allocations_before = allocations_on_this_thread();
+        auto start = benchmark_clock::now();
+        for (size_t p = 0; p != passes; ++p) {
+            Vector result;
+            for (auto const &part : parts) {
+                append(result, part);
+            }
+            total += result.size();
+        }
+        double concat_us = seconds_since(start) * 1e6 / passes;
+        size_t allocations = allocations_on_this_thread() - allocations_before;
+        EXPECT_EQ(passes * parts_count * part_size, total);
+
+        std::cout << std::setw(22) << name << std::setw(6) << part_size << std::setw(14) << concat_us
+                  << std::setw(12) << static_cast<double>(allocations) / passes << '\n';
+    }
+
+    // Compares two equal 10^6-element vectors, so every element is looked at, with the
+    // operators and with the standard algorithms they used to call.
+    template<typename T>
+    void compare_row(char const *name) {
+        size_t const elements = 1000000;
+        size_t const passes = 50;
+        vector<T> a;
+        for (size_t i = 0; i != elements; ++i) {
+            a.push_back(static_cast<T>(i % 100));
+        }
+        vector<T> b(a.cbegin(), a.cend());
+
+        auto time_ns = [&](auto compare) {
+            size_t hits = 0;
+            auto start = benchmark_clock::now();
+            for (size_t p = 0; p != passes; ++p) {
+                hits += compare(a.cview(), b.cview());
+            }
+            EXPECT_NE(size_t(-1), hits);
+            return seconds_since(start) * 1e9 / (passes * elements);
+        };
+        double std_equal_ns = time_ns([](auto const &x, auto const &y) {
+            return std::equal(x.cbegin(), x.cend(), y.cbegin(), y.cend());
+        });
+        double equal_ns = time_ns([](auto const &x, auto const &y) {
+            return x == y;
+        });
+        double std_less_ns = time_ns([](auto const &x, auto const &y) {
+            return std::lexicographical_compare(x.cbegin(), x.cend(), y.cbegin(), y.cend());
+        });
+        double less_ns = time_ns([](auto const &x, auto const &y) {
+            return x < y;
+        });
+        EXPECT_TRUE(a == b);
+
+        std::cout << std::setw(14) << name << std::setw(14) << std_equal_ns << std::setw(10) << equal_ns
+                  << std::setw(18) << std_less_ns << std::setw(10) << less_ns << '\n';
+    }
+
+    // Hashes a 10^6-element snapshot that another owner shares, as a hash map lookup would.
+    template<typename Vector>
+    void snapshot_hash_row(char const *name, size_t (*hash)(Vector const &)) {
+        size_t const elements = 1000000;
+        size_t const passes = 100;
+        auto snapshot = make_sequence<Vector>(elements);
+        Vector owner = snapshot;
+
+        size_t combined = 0;
+        auto start = benchmark_clock::now();
+        for (size_t p = 0; p != passes; ++p) {
+            combined ^= hash(snapshot);
+        }
+        double hash_us = seconds_since(start) * 1e6 / passes;
+        EXPECT_EQ(passes % 2 == 0 ? size_t(0) : hash(owner), combined);
+
+        std::cout << std::setw(26) << name << std::setw(12) << hash_us
+                  << std::setw(12) << hash_us * 1e3 / (elements * sizeof(int)) << '\n';
+    }
+
+    // Dedups 4000 handles to 200 shared snapshots of 1000 ints that only differ in the last
+    // element, by comparing each with the distinct ones found so far.
+    template<typename Vector>
+    void dedup_row(char const *name, bool hash_first) {
+        size_t const distinct = 200;
+        size_t const handles = 4000;
+        std::vector<Vector> snapshots;
+        for (size_t i = 0; i != distinct; ++i) {
+            snapshots.push_back(make_sequence<Vector>(1000));
+            snapshots.back().back() = -static_cast<int>(i);
+        }
+        std::vector<Vector> items;
+        for (size_t i = 0; i != handles; ++i) {
+            items.push_back(snapshots[i * 7919 % distinct]);
+        }
+
+        std::vector<Vector> unique;
+        auto start = benchmark_clock::now();
+        for (auto const &item : items) {
+            if (hash_first) {
+                item.hash();
+            }
+            if (std::find(unique.begin(), unique.end(), item) == unique.end()) {
+                unique.push_back(item);
+            }
+        }
+        double dedup_us = seconds_since(start) * 1e6;
+        EXPECT_EQ(distinct, unique.size());
+
+        std::cout << std::setw(22) << name << std::setw(12) << dedup_us << '\n';
+    }
+
+    // Detaches a copy of a shared 256 MiB vector of an opted-in type, with bulk copies from
+    // threshold_bytes up split across parallel_pool.
+    void detach_row(char const *name, size_t threshold_bytes) {
+        size_t const elements = size_t(1) << 26;
+        size_t const passes = 5;
+        size_t old_threshold = parallel_pool::threshold_bytes.exchange(threshold_bytes);
+        base_vector<parallel_int> snapshot(elements, parallel_int{1});
+
+        long long sum = 0;
+        auto start = benchmark_clock::now();
+        for (size_t p = 0; p != passes; ++p) {
+            base_vector<parallel_int> copy = snapshot;
+            copy[0].value = 2;
+            sum += copy[0].value;
+        }
+        double detach_ms = seconds_since(start) * 1e3 / passes;
+        EXPECT_EQ(static_cast<long long>(passes) * 2, sum);
+        parallel_pool::threshold_bytes = old_threshold;
+
+        std::cout << std::setw(12) << name << std::setw(13) << detach_ms << '\n';
+    }
+
+    template<typename T>
+    void layout_row(char const *name) {
+        std::cout << std::setw(12) << name << std::setw(8) << sizeof(T) << std::setw(8)
+                  << vector_layout<T>::inline_capacity << std::setw(8) << vector_layout<T>::bytes << '\n';
+    }
+
+    template<size_t... Ns>
+    void inline_capacity_sweep(std::index_sequence<Ns...>) {
+        std::cout << "   N  items  allocs/vec  push ns/el  iter ns/el\n";
+        for (size_t items : {2, 4, 8, 16}) {
+            (inline_capacity_row<Ns>(items), ...);
+        }
+    }
+}
+
+TEST(threads, shared_snapshot_stress) {
+    shared_vector<int> const snapshot = make_sequence<shared_vector<int>>(1000);
+    std::vector<std::thread> workers;
+    for (size_t t = 0; t != 64; ++t) {
+        workers.emplace_back([&snapshot, t] {
+            for (size_t i = 0; i != 200; ++i) {
+                shared_vector<int> copy = snapshot;
+                shared_vector<int> second = copy;
+                if (i % 4 == t % 4) {
+                    copy[i] = -1;
+                    EXPECT_EQ(-1, copy[i]);
+                    EXPECT_EQ(static_cast<int>(i), second[i]);
+                }
+                second.push_back(42);
+                EXPECT_EQ(1001u, second.size());
+            }
+        });
+    }
+    for (auto &worker : workers) {
+        worker.join();
+    }
+    for (size_t i = 0; i != snapshot.size(); ++i) {
+        EXPECT_EQ(static_cast<int>(i), snapshot[i]);
+    }
+}
+
+TEST(threads, copy_destroy_throughput) {
+    size_t const copies_per_thread = 100000;
+    auto plain = make_sequence<vector<int>>(1000);
+    std::cout << "plain_counter, 1 thread: "
+              << copy_destroy_throughput(plain, 1, copies_per_thread) << " copies/s\n";
+
+    auto shared = make_sequence<shared_vector<int>>(1000);
+    for (size_t threads = 1; threads <= 64; threads *= 2) {
+        std::cout << "atomic_counter, " << threads << " threads: "
+                  << copy_destroy_throughput(shared, threads, copies_per_thread) << " copies/s\n";
+    }
+}
+
+TEST(small_vector, inline_capacity_sweep) {
+    inline_capacity_sweep(std::index_sequence<1, 2, 4, 8, 16>());
+}
+
+TEST(small_vector, layout) {
+    struct record_256 {
+        char bytes[256];
+    };
+
+    std::cout << "     element  sizeof  inline  vector\n";
+    layout_row<int>("int");
+    layout_row<double>("double");
+    layout_row<long double>("long double");
+    layout_row<std::string>("std::string");
+    layout_row<record_256>("256 bytes");
+}
+
+TEST(growth, policies) {
+    std::cout << "                policy  elements  reallocs  peak KiB  final KiB  slack %  push ns\n";
+    for (size_t elements : {1000000, 1500000}) {
+        growth_policy_row<one_and_a_half_growth>("x1.5", elements);
+        growth_policy_row<golden_ratio_growth>("golden ratio", elements);
+        growth_policy_row<doubling_growth>("x2", elements);
+        growth_policy_row<size_class_growth<one_and_a_half_growth>>("x1.5, size classes", elements);
+        growth_policy_row<size_class_growth<doubling_growth>>("x2, size classes", elements);
+    }
+}
+
+TEST(header, compact_memory_savings) {
+    std::cout << "                  header  bytes/vec  heap MiB  build ns/vec\n";
+    header_row<int, plain_counter>("int, size_t header");
+    header_row<int, compact_counter>("int, 32-bit header");
+    header_row<long long, plain_counter>("long long, size_t header");
+    header_row<long long, compact_counter>("long long, 32-bit header");
+}
+
+TEST(cow, snapshot_readers) {
+    std::cout << "      vector   us/reader   news/reader\n";
+    snapshot_reader_row<vector<record>>("vector", [](record const &item) {
+        return item.key;
+    });
+    snapshot_reader_row<cow_vector<record>>("cow_vector", [](cow_vector<record>::reference item) {
+        return item.get().key;
+    });
+}
+
+TEST(persistent, shared_snapshot_write) {
+    std::cout << "            vector  elements  us/copy+write  scan ns/el\n";
+    for (size_t elements : {1000, 100000, 10000000}) {
+        snapshot_write_row<vector<int>>("vector", elements);
+        snapshot_write_row<persistent_vector<int>>("persistent_vector", elements);
+    }
+}
+
+TEST(accessors, indexed_sum) {
+    size_t const elements = 10000000;
+    auto mine = make_sequence<vector<int>>(elements);
+    std::vector<int> stl(mine.cbegin(), mine.cend());
+    std::cout << "            vector  ns/element\n";
+    indexed_sum_row("std::vector", stl);
+    indexed_sum_row("vector const", static_cast<vector<int> const &>(mine));
+    indexed_sum_row("vector", mine);
+}
+
+TEST(insert, concatenate_1000_vectors) {
+    auto push_each = [](auto &result, auto const &part) {
+        for (auto const &item : part) {
+            result.push_back(item);
+        }
+    };
+    auto append_range = [](auto &result, auto const &part) {
+        result.append_range(part);
+    };
+    std::cout << "                method  part  us/concat  allocs/concat\n";
+    for (size_t part_size : {3, 100}) {
+        concat_row<std::vector<record>>("std::vector insert", part_size, [](auto &result, auto const &part) {
+            result.insert(result.end(), part.begin(), part.end());
+        });
+        concat_row<base_vector<record>>("base_vector push_back", part_size, push_each);
+        concat_row<base_vector<record>>("base_vector append", part_size, append_range);
+        concat_row<vector<record>>("vector push_back", part_size, push_each);
+        concat_row<vector<record>>("vector append", part_size, append_range);
+    }
+}
+
+TEST(compare, simd_kernels) {
+    std::cout << "          type  std::equal ns  == ns  lexicographical ns  < ns   (per element)\n";
+    compare_row<unsigned char>("unsigned char");
+    compare_row<int>("int");
+    compare_row<long long>("long long");
+    compare_row<float>("float");
+    compare_row<double>("double");
+}
+
+TEST(hash, shared_snapshot) {
+    typedef base_vector<int, hash_caching<plain_counter>> hashed_vector;
+    std::cout << "                    hasher  us/hash  ns/byte\n";
+    snapshot_hash_row<vector<int>>("std::hash<string_view>", [](vector<int> const &v) {
+        return std::hash<std::string_view>()(
+                std::string_view(reinterpret_cast<char const *>(v.data()), v.size() * sizeof(int)));
+    });
+    snapshot_hash_row<vector<int>>("std::hash<vector>", [](vector<int> const &v) {
+        return std::hash<vector<int>>()(v);
+    });
+    snapshot_hash_row<hashed_vector>("std::hash, cached", [](hashed_vector const &v) {
+        return std::hash<hashed_vector>()(v);
+    });
+}
+
+TEST(compare, dedup_shared_snapshots) {
+    std::cout << "                vector   us/dedup\n";
+    dedup_row<vector<int>>("vector", false);
+    dedup_row<base_vector<int, hash_caching<plain_counter>>>("hash_caching", true);
+}
+
+TEST(parallel, detach_256_mib) {
+    std::cout << "  bulk copy  ms/detach   (" << std::thread::hardware_concurrency() << " hardware threads)\n";
+    detach_row("serial", std::numeric_limits<size_t>::max());
+    detach_row("parallel", size_t(1) << 24);
+}
+
+TEST(pmr, request_allocation_latency) {
+    std::cout << "              vector  us/request  news/request\n";
+    request_row<vector<record>>("operator new", [](std::pmr::memory_resource &) {
+        return vector<record>();
+    });
+    request_row<pmr::vector<record>>("request_arena", [](std::pmr::memory_resource &arena) {
+        return pmr::vector<record>(&arena);
+    });
+}
@@ -0,0 +1,200 @@
+#ifndef VECTOR_VECTOR_PARALLEL_H
+#define VECTOR_VECTOR_PARALLEL_H
+
+#include <cstddef>
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+// Element types whose copy constructor may run on several threads at once. Bulk copies and
+// fills of these are split across parallel_pool once they reach parallel_pool::threshold_bytes.
+// No type is by default, since the pool's threads would then start behind the back of every
+// program that copies a big vector; specialize this to true_type to opt a type in.
+// Specializations may throw from their copy constructors; see parallel_construct().
+template<typename T>
+struct is_parallel_copyable : std::false_type {};
+
+template<typename T>
+inline constexpr bool is_parallel_copyable_v = is_parallel_copyable<T>::value;
+
+// A few threads, started on first use, that run the chunks of bulk copies. The calling thread
+// runs chunk 0 itself and then only waits, so it never picks up other work. Fault injection,
+// which is per thread, therefore sees the same sequence on every run. A chunk that starts a
+// bulk copy of its own runs it serially instead of waiting on the pool.
+class parallel_pool {
+public:
+    static constexpr size_t max_chunks = 8;
+
+    // Smaller copies are not worth waking the workers for; adjustable at run time.
+    static inline std::atomic<size_t> threshold_bytes{size_t(1) << 24};
+
+    static parallel_pool &instance() {
+        static parallel_pool pool;
+        return pool;
+    }
+
+    size_t chunks_for(size_t bytes) const noexcept {
+        if (on_worker_ || bytes < threshold_bytes.load(std::memory_order_relaxed)) {
+            return 1;
+        }
+        return workers_.size() + 1;
+    }
+
+    // Calls run_chunk(i) for every i in [0, chunks) and stores what chunk i threw in errors[i].
+    template<typename RunChunk>
+    void run(size_t chunks, RunChunk &run_chunk, std::exception_ptr *errors) noexcept {
+        batch work{&invoke<RunChunk>, &run_chunk, errors, chunks, 1, 0, nullptr};
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            batch **tail = &pending_;
+            while (*tail) {
+                tail = &(*tail)->next_batch;
+            }
+            *tail = &work;
+        }
+        work_ready_.notify_all();
+        invoke<RunChunk>(&run_chunk, 0, errors[0]);
+
+        std::unique_lock<std::mutex> lock(mutex_);
+        ++work.finished;
+        work_done_.wait(lock, [&work] {
+            return work.finished == work.chunks;
+        });
+    }
+
+    parallel_pool(parallel_pool const &) = delete;
+
+    parallel_pool &operator=(parallel_pool const &) = delete;
+
+    ~parallel_pool() {
+        stop();
+    }
+
+private:
+    struct batch {
+        void (*run)(void *, size_t, std::exception_ptr &) noexcept;
+        void *run_chunk;
+        std::exception_ptr *errors;
+        size_t chunks;
+        size_t next;
+        size_t finished;
+        batch *next_batch;
+    };
+
+    std::mutex mutex_;
+    std::condition_variable work_ready_;
+    std::condition_variable work_done_;
+    batch *pending_ = nullptr;
+    bool stopping_ = false;
+    std::vector<std::thread> workers_;
+
+    static inline thread_local bool on_worker_ = false;
+
+    // At least one worker even on a single core, so that every machine takes the same path.
+    parallel_pool() {
+        size_t threads = std::clamp<size_t>(std::thread::hardware_concurrency(), 2, max_chunks);
+        try {
+            workers_.reserve(threads - 1);
+            for (size_t i = 1; i != threads; ++i) {
+                workers_.emplace_back([this] {
+                    work();
+                });
+            }
+        } catch (...) {
+            stop();
+            throw;
+        }
+    }
+
+    void stop() noexcept {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stopping_ = true;
+        }
+        work_ready_.notify_all();
+        for (auto &worker : workers_) {
+            worker.join();
+        }
+    }
+
+    template<typename RunChunk>
+    static void invoke(void *run_chunk, size_t chunk, std::exception_ptr &error) noexcept {
+        try {
+            (*static_cast<RunChunk *>(run_chunk))(chunk);
+        } catch (...) {
+            error = std::current_exception();
+        }
+    }
+
+    void work() noexcept {
+        on_worker_ = true;
+        std::unique_lock<std::mutex> lock(mutex_);
+        for (;;) {
+            work_ready_.wait(lock, [this] {
+                return stopping_ || pending_;
+            });
+            if (!pending_) {
+                return;
+            }
+            batch *current = pending_;
+            size_t chunk = current->next++;
+            if (current->next == current->chunks) {
+                pending_ = current->next_batch;
+            }
+            lock.unlock();
+            current->run(current->run_chunk, chunk, current->errors[chunk]);
+            lock.lock();
+            if (++current->finished == current->chunks) {
+                work_done_.notify_all();
+            }
+        }
+    }
+};
+
+// Constructs count elements at dest, calling construct(dest + offset, offset, n) for chunks of
+// n elements that together cover [0, count); big enough ranges of is_parallel_copyable types
+// are spread over parallel_pool. A chunk that throws must leave nothing behind, as the
+// uninitialized_* algorithms do. The chunks that succeeded are then destroyed and the first
+// exception is rethrown, so a failed call constructs nothing.
+template<typename T, typename Construct>
+void parallel_construct(T *dest, size_t count, Construct construct) {
+    size_t chunks = 1;
+    if constexpr (is_parallel_copyable_v<T>) {
+        if (count * sizeof(T) >= parallel_pool::threshold_bytes.load(std::memory_order_relaxed)) {
+            chunks = std::min(parallel_pool::instance().chunks_for(count * sizeof(T)), count);
+        }
+    }
+    if (chunks <= 1) {
+        construct(dest, 0, count);
+        return;
+    }
+    auto chunk_begin = [count, chunks](size_t chunk) {
+        return count / chunks * chunk + std::min(chunk, count % chunks);
+    };
+    auto run_chunk = [&](size_t chunk) {
+        size_t begin = chunk_begin(chunk);
+        construct(dest + begin, begin, chunk_begin(chunk + 1) - begin);
+    };
+    std::exception_ptr errors[parallel_pool::max_chunks];
+    parallel_pool::instance().run(chunks, run_chunk, errors);
+
+    std::exception_ptr *first_error = std::find_if(errors, errors + chunks, [](std::exception_ptr const &error) {
+        return error != nullptr;
+    });
+    if (first_error != errors + chunks) {
+        for (size_t chunk = 0; chunk != chunks; ++chunk) {
+            if (!errors[chunk]) {
+                std::destroy(dest + chunk_begin(chunk), dest + chunk_begin(chunk + 1));
+            }
+        }
+        std::rethrow_exception(*first_error);
+    }
+}
+
+#endif //VECTOR_VECTOR_PARALLEL_H
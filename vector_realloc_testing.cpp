@@ -0,0 +1,157 @@
+#include <gtest/gtest.h>
+#include "fault_injection.h"
+#include "vector.h"
+
+// Built without VECTOR_FAULT_INJECTION, so blocks of trivially relocatable elements come from
+// malloc and grow with realloc. operator new is still the counting one from fault_injection.cpp,
+// which shows that none of these blocks go through it.
+
+namespace
+{
+struct point
+{
+    int x, y;
+};
+
+bool operator==(point a, point b)
+{
+    return a.x == b.x && a.y == b.y;
+}
+
+base_vector<int> iota(int count)
+{
+    base_vector<int> result;
+    for (int i = 0; i != count; ++i)
+        result.push_back(i);
+    return result;
+}
+}
+
+TEST(realloc, growth
+)
+{
+size_t allocations = allocations_on_this_thread();
+base_vector<int> c = iota(1000);
+c.reserve(5000);
+EXPECT_EQ(5000u, c.capacity());
+c.resize(6000);
+c.resize(7000, 3);
+c.emplace(c.cbegin() + 1, -1);
+EXPECT_EQ(0u, allocations_on_this_thread() - allocations);
+EXPECT_EQ(7001u, c.size());
+EXPECT_EQ(0, c[0]);
+EXPECT_EQ(-1, c[1]);
+EXPECT_EQ(999, c[1000]);
+EXPECT_EQ(0, c[6000]);
+EXPECT_EQ(3, c[7000]);
+}
+
+TEST(realloc, full_block_takes_own_element
+)
+{
+base_vector<int> c = iota(100);
+c.shrink_to_fit();
+c.push_back(c[7]);
+EXPECT_EQ(7, c[100]);
+c.shrink_to_fit();
+c.emplace(c.cbegin(), c[100]);
+EXPECT_EQ(7, c[0]);
+c.shrink_to_fit();
+c.resize(200, c[50]);
+EXPECT_EQ(49, c[199]);
+EXPECT_EQ(200u, c.size());
+}
+
+TEST(realloc, detach_shared_block
+)
+{
+size_t allocations = allocations_on_this_thread();
+base_vector<int> c = iota(100);
+base_vector<int> d = c;
+base_vector<int> e = c;
+base_vector<int> const &cc = c, &cd = d, &ce = e;
+EXPECT_EQ(cc.data(), cd.data());
+d.push_back(100);
+e.reserve(1000);
+e[0] = -1;
+for (int i = 0; i != 1000; ++i)
+d.push_back(i);
+EXPECT_EQ(0u, allocations_on_this_thread() - allocations);
+EXPECT_NE(cc.data(), cd.data());
+EXPECT_NE(cc.data(), ce.data());
+EXPECT_EQ(100u, c.size());
+EXPECT_EQ(0, c[0]);
+EXPECT_EQ(99, c[99]);
+EXPECT_EQ(1101u, d.size());
+EXPECT_EQ(100, d[100]);
+EXPECT_EQ(999, d[1100]);
+EXPECT_EQ(-1, e[0]);
+EXPECT_EQ(1000u, e.capacity());
+}
+
+TEST(realloc, shrink_to_fit_and_append_uninitialized
+)
+{
+base_vector<int> c = iota(100);
+c.reserve(1000);
+c.shrink_to_fit();
+EXPECT_EQ(100u, c.capacity());
+span<int> tail = c.append_uninitialized(50);
+for (size_t i = 0; i != tail.size(); ++i)
+tail[i] = 100 + static_cast<int>(i);
+EXPECT_EQ(150u, c.size());
+EXPECT_LE(150u, c.capacity());
+c.resize_default_init(2000);
+c[1999] = 1999;
+c.shrink_to_fit();
+EXPECT_EQ(2000u, c.capacity());
+EXPECT_EQ(99, c[99]);
+EXPECT_EQ(149, c[149]);
+EXPECT_EQ(1999, c[1999]);
+
+base_vector<int> d = c;
+d.shrink_to_fit();
+d.append_uninitialized(1)[0] = -1;
+EXPECT_EQ(2000u, c.size());
+EXPECT_EQ(-1, d[2000]);
+}
+
+TEST(realloc, pod_elements
+)
+{
+size_t allocations = allocations_on_this_thread();
+base_vector<point> c;
+for (int i = 0; i != 500; ++i)
+c.push_back(point{i, -i});
+base_vector<point> d = c;
+d.insert(d.cbegin() + 10, c.cbegin(), c.cbegin() + 100);
+c.emplace_back(point{500, -500});
+c.shrink_to_fit();
+c.append_uninitialized(2)[1] = point{7, 7};
+EXPECT_EQ(0u, allocations_on_this_thread() - allocations);
+EXPECT_EQ(503u, c.size());
+EXPECT_EQ((point{500, -500}), c[500]);
+EXPECT_EQ((point{7, 7}), c[502]);
+EXPECT_EQ(600u, d.size());
+EXPECT_EQ((point{0, 0}), d[10]);
+EXPECT_EQ((point{10, -10}), d[110]);
+EXPECT_EQ((point{499, -499}), d[599]);
+}
+
+TEST(realloc, vector_spills_to_realloc
+)
+{
+size_t allocations = allocations_on_this_thread();
+vector<int> c;
+for (int i = 0; i != 300; ++i)
+c.push_back(i);
+vector<int> d = c;
+d.push_back(300);
+c.shrink_to_fit();
+c.append_uninitialized(1)[0] = -1;
+EXPECT_EQ(0u, allocations_on_this_thread() - allocations);
+EXPECT_EQ(301u, c.size());
+EXPECT_EQ(299, c[299]);
+EXPECT_EQ(-1, c[300]);
+EXPECT_EQ(300, d[300]);
+}
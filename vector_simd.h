@@ -0,0 +1,228 @@
+#ifndef VECTOR_VECTOR_SIMD_H
+#define VECTOR_VECTOR_SIMD_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+#include <functional>
+#include <type_traits>
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__SSE2__) && defined(__GNUC__)
+#define VECTOR_SIMD_X86
+#include <immintrin.h>
+#endif
+
+// Element comparison and hashing behind the vectors' ==, < and std::hash. Integers and enums
+// are equal exactly when their bytes are, so equality is a memcmp and ordering first looks for
+// the differing element bytewise. float and double are compared lane by lane, which keeps
+// 0.0 == -0.0 and NaN != NaN. The scans use SSE2, or AVX2 when the CPU running the program has
+// it; anything else goes through the standard algorithms. For the same reason, integers and
+// enums are hashed over their bytes, 32 at a time in four independent lanes.
+
+template<typename T>
+inline constexpr bool is_bytewise_comparable_v = std::is_integral_v<T> || std::is_enum_v<T>;
+
+// memcmp orders these the way their operator< does.
+template<typename T>
+inline constexpr bool is_memcmp_ordered_v = (sizeof(T) == 1 && std::is_unsigned_v<T>) || std::is_same_v<T, std::byte>;
+
+template<typename T>
+inline constexpr bool has_simd_compare_v =
+        is_bytewise_comparable_v<T> || std::is_same_v<T, float> || std::is_same_v<T, double>;
+
+#ifdef VECTOR_SIMD_X86
+inline bool cpu_has_avx2() noexcept {
+    static bool const result = __builtin_cpu_supports("avx2");
+    return result;
+}
+
+inline size_t first_byte_mismatch_sse2(unsigned char const *a, unsigned char const *b, size_t n) noexcept {
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m128i x = _mm_loadu_si128(reinterpret_cast<__m128i const *>(a + i));
+        __m128i y = _mm_loadu_si128(reinterpret_cast<__m128i const *>(b + i));
+        unsigned mask = static_cast<unsigned>(_mm_movemask_epi8(_mm_cmpeq_epi8(x, y))) ^ 0xFFFFu;
+        if (mask != 0) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+    for (; i != n && a[i] == b[i]; ++i) {}
+    return i;
+}
+
+__attribute__((target("avx2")))
+inline size_t first_byte_mismatch_avx2(unsigned char const *a, unsigned char const *b, size_t n) noexcept {
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        __m256i x = _mm256_loadu_si256(reinterpret_cast<__m256i const *>(a + i));
+        __m256i y = _mm256_loadu_si256(reinterpret_cast<__m256i const *>(b + i));
+        unsigned mask = ~static_cast<unsigned>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(x, y)));
+        if (mask != 0) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+    return i + first_byte_mismatch_sse2(a + i, b + i, n - i);
+}
+
+inline size_t first_mismatch_sse2(float const *a, float const *b, size_t n) noexcept {
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        unsigned mask = static_cast<unsigned>(_mm_movemask_ps(_mm_cmpeq_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i)))) ^ 0xFu;
+        if (mask != 0) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+    for (; i != n && a[i] == b[i]; ++i) {}
+    return i;
+}
+
+__attribute__((target("avx2")))
+inline size_t first_mismatch_avx2(float const *a, float const *b, size_t n) noexcept {
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256 eq = _mm256_cmp_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i), _CMP_EQ_OQ);
+        unsigned mask = static_cast<unsigned>(_mm256_movemask_ps(eq)) ^ 0xFFu;
+        if (mask != 0) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+    return i + first_mismatch_sse2(a + i, b + i, n - i);
+}
+
+inline size_t first_mismatch_sse2(double const *a, double const *b, size_t n) noexcept {
+    size_t i = 0;
+    for (; i + 2 <= n; i += 2) {
+        unsigned mask = static_cast<unsigned>(_mm_movemask_pd(_mm_cmpeq_pd(_mm_loadu_pd(a + i), _mm_loadu_pd(b + i)))) ^ 0x3u;
+        if (mask != 0) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+    for (; i != n && a[i] == b[i]; ++i) {}
+    return i;
+}
+
+__attribute__((target("avx2")))
+inline size_t first_mismatch_avx2(double const *a, double const *b, size_t n) noexcept {
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m256d eq = _mm256_cmp_pd(_mm256_loadu_pd(a + i), _mm256_loadu_pd(b + i), _CMP_EQ_OQ);
+        unsigned mask = static_cast<unsigned>(_mm256_movemask_pd(eq)) ^ 0xFu;
+        if (mask != 0) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+    return i + first_mismatch_sse2(a + i, b + i, n - i);
+}
+#endif
+
+// Index of the first i with !(a[i] == b[i]), or n if there is none.
+template<typename T>
+size_t first_mismatch(T const *a, T const *b, size_t n) {
+#ifdef VECTOR_SIMD_X86
+    if constexpr (is_bytewise_comparable_v<T>) {
+        auto const *x = reinterpret_cast<unsigned char const *>(a);
+        auto const *y = reinterpret_cast<unsigned char const *>(b);
+        size_t bytes = n * sizeof(T);
+        return (cpu_has_avx2() ? first_byte_mismatch_avx2(x, y, bytes) : first_byte_mismatch_sse2(x, y, bytes)) / sizeof(T);
+    } else if constexpr (std::is_same_v<T, float> || std::is_same_v<T, double>) {
+        return cpu_has_avx2() ? first_mismatch_avx2(a, b, n) : first_mismatch_sse2(a, b, n);
+    }
+#endif
+    return static_cast<size_t>(std::mismatch(a, a + n, b).first - a);
+}
+
+template<typename T>
+bool elements_equal(T const *a, size_t a_size, T const *b, size_t b_size) {
+    if (a_size != b_size) {
+        return false;
+    }
+    if constexpr (is_bytewise_comparable_v<T>) {
+        return a_size == 0 || std::memcmp(a, b, a_size * sizeof(T)) == 0;
+    } else if constexpr (has_simd_compare_v<T>) {
+        return first_mismatch(a, b, a_size) == a_size;
+    } else {
+        return std::equal(a, a + a_size, b);
+    }
+}
+
+template<typename T>
+bool elements_less(T const *a, size_t a_size, T const *b, size_t b_size) {
+    size_t n = std::min(a_size, b_size);
+    if constexpr (is_memcmp_ordered_v<T>) {
+        int order = n == 0 ? 0 : std::memcmp(a, b, n);
+        return order != 0 ? order < 0 : a_size < b_size;
+    } else if constexpr (has_simd_compare_v<T>) {
+        for (size_t i = 0;; ++i) {
+            i += first_mismatch(a + i, b + i, n - i);
+            if (i == n) {
+                return a_size < b_size;
+            }
+            if (a[i] < b[i]) {
+                return true;
+            }
+            if (b[i] < a[i]) {
+                return false;
+            }
+            // Unordered, like a NaN: lexicographical_compare moves on to the next element.
+        }
+    } else {
+        return std::lexicographical_compare(a, a + a_size, b, b + b_size);
+    }
+}
+
+inline uint64_t hash_mix(uint64_t x) noexcept {
+    x ^= x >> 32;
+    x *= 0xd6e8feb86659fd93ull;
+    x ^= x >> 32;
+    x *= 0xd6e8feb86659fd93ull;
+    x ^= x >> 32;
+    return x;
+}
+
+inline uint64_t load_word(unsigned char const *bytes) noexcept {
+    uint64_t word;
+    std::memcpy(&word, bytes, sizeof(word));
+    return word;
+}
+
+// The lanes have no dependency on each other, so the multiplications overlap.
+inline uint64_t hash_bytes(void const *data, size_t size) noexcept {
+    uint64_t const k = 0x9e3779b97f4a7c15ull;
+    auto const *bytes = static_cast<unsigned char const *>(data);
+    uint64_t lanes[4] = {size, size ^ k, size ^ (k << 1), size ^ (k >> 1)};
+    size_t i = 0;
+    for (; i + 32 <= size; i += 32) {
+        for (size_t lane = 0; lane != 4; ++lane) {
+            lanes[lane] = (lanes[lane] ^ load_word(bytes + i + 8 * lane)) * k;
+            lanes[lane] ^= lanes[lane] >> 29;
+        }
+    }
+    uint64_t result = hash_mix(lanes[0]) ^ hash_mix(lanes[1] + 1) ^ hash_mix(lanes[2] + 2) ^ hash_mix(lanes[3] + 3);
+    for (; i + 8 <= size; i += 8) {
+        result = hash_mix(result ^ load_word(bytes + i));
+    }
+    if (i != size) {
+        uint64_t tail = 0;
+        std::memcpy(&tail, bytes + i, size - i);
+        result = hash_mix(result ^ tail ^ k);
+    }
+    return result;
+}
+
+// A hash consistent with elements_equal(). It is never 0, so 0 can mean "not computed".
+template<typename T>
+size_t elements_hash(T const *items, size_t size) {
+    uint64_t result;
+    if constexpr (is_bytewise_comparable_v<T>) {
+        result = hash_bytes(items, size * sizeof(T));
+    } else {
+        result = size;
+        for (size_t i = 0; i != size; ++i) {
+            result = hash_mix(result ^ std::hash<T>()(items[i]));
+        }
+    }
+    return static_cast<size_t>(result) | 1u;
+}
+
+#endif //VECTOR_VECTOR_SIMD_H
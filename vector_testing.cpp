@@ -1,10 +1,208 @@
 #include <gtest/gtest.h>
+#include <list>
+#include <sstream>
+#include <thread>
+#include <unordered_set>
 #include "fault_injection.h"
 #include "counted.h"
 #include "vector.h"
+#include "persistent_vector.h"
 
 typedef vector<counted> container;
 typedef vector<int> container_int;
+typedef small_vector<counted, 4> small_container;
+
+namespace
+{
+struct copy_tracked
+{
+    static size_t copies;
+
+    copy_tracked(int value) : value(value) {}
+    copy_tracked(copy_tracked const &other) : value(other.value) { ++copies; }
+    copy_tracked(copy_tracked &&other) noexcept = default;
+    copy_tracked &operator=(copy_tracked const &other) = default;
+    copy_tracked &operator=(copy_tracked &&other) noexcept = default;
+
+    int value;
+};
+
+size_t copy_tracked::copies = 0;
+
+// Hashed through std::hash, which counts the calls, as does ==.
+struct hash_tracked
+{
+    static size_t hashes;
+    static size_t compares;
+
+    hash_tracked(int value) : value(value) {}
+
+    friend bool operator==(hash_tracked const &lhs, hash_tracked const &rhs) { ++compares; return lhs.value == rhs.value; }
+
+    int value;
+};
+
+size_t hash_tracked::hashes = 0;
+size_t hash_tracked::compares = 0;
+
+// Copies may fail and may run on the pool's threads, which never inject faults.
+struct parallel_tracked
+{
+    static std::atomic<int> instances;
+
+    parallel_tracked(int value) : value(value) { ++instances; }
+    parallel_tracked(parallel_tracked const &other) : value(other.value) { fault_injection_point(); ++instances; }
+    parallel_tracked &operator=(parallel_tracked const &other) = default;
+    ~parallel_tracked() { --instances; }
+
+    int value;
+};
+
+std::atomic<int> parallel_tracked::instances(0);
+
+// Counts the copies made on threads other than test_thread. Only thread_tracked<true> opts in
+// to parallel copies.
+template <bool Parallel>
+struct thread_tracked
+{
+    static inline std::thread::id test_thread;
+    static inline std::atomic<int> foreign_copies{0};
+
+    thread_tracked(int value) : value(value) {}
+    thread_tracked(thread_tracked const &other) : value(other.value)
+    {
+        if (std::this_thread::get_id() != test_thread)
+            ++foreign_copies;
+    }
+    thread_tracked &operator=(thread_tracked const &other) = default;
+
+    int value;
+};
+
+// Trivially copyable, and opted in to parallel copies unlike int.
+struct parallel_int
+{
+    int value;
+
+    friend bool operator==(parallel_int a, parallel_int b) { return a.value == b.value; }
+};
+
+// Lowers the size at which bulk copies go parallel for the length of a test.
+struct parallel_threshold_guard
+{
+    explicit parallel_threshold_guard(size_t bytes) : old(parallel_pool::threshold_bytes.exchange(bytes)) { parallel_pool::instance(); }
+    ~parallel_threshold_guard() { parallel_pool::threshold_bytes = old; }
+
+    size_t old;
+};
+}
+
+template <>
+struct std::hash<hash_tracked>
+{
+    size_t operator()(hash_tracked const &item) const
+    {
+        ++hash_tracked::hashes;
+        return std::hash<int>()(item.value);
+    }
+};
+
+template <>
+struct is_parallel_copyable<parallel_tracked> : std::true_type {};
+
+template <>
+struct is_parallel_copyable<thread_tracked<true>> : std::true_type {};
+
+template <>
+struct is_parallel_copyable<parallel_int> : std::true_type {};
+
+namespace
+{
+
+// A counted that also reports how many copies were constructed, so that faulty_run can check both.
+struct counted_copies : counted
+{
+    static size_t copies;
+
+    counted_copies(int value) : counted(value) {}
+    counted_copies(counted_copies const &other) : counted(other) { ++copies; }
+};
+
+size_t counted_copies::copies = 0;
+
+struct alignas(64) cache_line
+{
+    cache_line(int value) : value(value) {}
+
+    int value;
+};
+
+struct boxed
+{
+    boxed(int value) : value(new int(value)) {}
+    boxed(boxed const &other) : value(new int(*other.value)) {}
+    boxed(boxed &&other) noexcept = default;
+    boxed &operator=(boxed const &other) { value.reset(new int(*other.value)); return *this; }
+    boxed &operator=(boxed &&other) noexcept = default;
+
+    std::unique_ptr<int> value;
+};
+}
+
+template<>
+struct is_trivially_relocatable<boxed> : std::true_type {};
+
+namespace
+{
+// Blocks are tagged with the heap that made them; live_blocks[tag] must drop back to zero.
+template <typename T>
+struct tagged_allocator
+{
+    typedef T value_type;
+
+    static int live_blocks[2];
+
+    explicit tagged_allocator(int tag) : tag(tag) {}
+
+    template <typename U>
+    tagged_allocator(tagged_allocator<U> const &other) : tag(other.tag) {}
+
+    T *allocate(size_t n)
+    {
+        T *result = static_cast<T *>(operator new(n * sizeof(T)));
+        ++tagged_allocator<char>::live_blocks[tag];
+        return result;
+    }
+
+    void deallocate(T *p, size_t)
+    {
+        --tagged_allocator<char>::live_blocks[tag];
+        operator delete(p);
+    }
+
+    friend bool operator==(tagged_allocator const &lhs, tagged_allocator const &rhs) { return lhs.tag == rhs.tag; }
+    friend bool operator!=(tagged_allocator const &lhs, tagged_allocator const &rhs) { return lhs.tag != rhs.tag; }
+
+    int tag;
+};
+
+template <typename T>
+int tagged_allocator<T>::live_blocks[2];
+
+typedef base_vector<counted, plain_counter, doubling_growth, tagged_allocator<counted>> tagged_container;
+}
+
+// Prints what the whole run did to the main thread's counters (configure with -DVECTOR_STATS=ON).
+struct vector_stats_dump : testing::Environment
+{
+    void TearDown() override
+    {
+        if (vector_stats::enabled)
+            vector_stats::local().dump(stdout);
+    }
+};
+
+testing::Environment *const vector_stats_environment = testing::AddGlobalTestEnvironment(new vector_stats_dump);
 
 TEST(correctness, default_ctor
 )
@@ -1661,6 +1859,1123 @@ EXPECT_EQ(5, c[2]);
 });
 }
 
+TEST(correctness, shared_vector_copy_on_write
+)
+{
+faulty_run([]
+{
+counted::no_new_instances_guard g;
+shared_vector<counted> c;
+c.push_back(1);
+c.push_back(2);
+c.push_back(3);
+
+shared_vector<counted> d = c;
+shared_vector<counted> e;
+e = d;
+d[0] = 10;
+e.pop_back();
+EXPECT_EQ(1, c[0]);
+EXPECT_EQ(10, d[0]);
+EXPECT_EQ(3u, c.size());
+EXPECT_EQ(3u, d.size());
+EXPECT_EQ(2u, e.size());
+});
+}
+
+TEST(correctness, move_ctor
+)
+{
+faulty_run([]
+{
+counted::no_new_instances_guard g;
+container c;
+c.push_back(1);
+c.push_back(2);
+c.push_back(3);
+
+container d = std::move(c);
+EXPECT_EQ(3u, d.size());
+EXPECT_EQ(1, d[0]);
+EXPECT_EQ(3, d[2]);
+});
+}
+
+TEST(correctness, move_assignment
+)
+{
+faulty_run([]
+{
+counted::no_new_instances_guard g;
+container c, d;
+c.push_back(1);
+c.push_back(2);
+d.push_back(3);
+
+d = std::move(c);
+EXPECT_EQ(2u, d.size());
+EXPECT_EQ(1, d[0]);
+EXPECT_EQ(2, d[1]);
+d = std::move(d);
+EXPECT_EQ(2u, d.size());
+});
+}
+
+TEST(correctness, single_to_heap_moves
+)
+{
+vector<copy_tracked> c;
+c.push_back(copy_tracked(1));
+copy_tracked::copies = 0;
+c.push_back(copy_tracked(2));
+EXPECT_EQ(0u, copy_tracked::copies);
+EXPECT_EQ(1, c[0].value);
+EXPECT_EQ(2, c[1].value);
+
+vector<copy_tracked> d;
+d.push_back(copy_tracked(3));
+d.reserve(10);
+EXPECT_EQ(0u, copy_tracked::copies);
+d.resize(4, copy_tracked(0));
+EXPECT_EQ(3u, copy_tracked::copies);
+EXPECT_EQ(3, d[0].value);
+}
+
+TEST(correctness, growth_moves_unshared
+)
+{
+copy_tracked::copies = 0;
+vector<copy_tracked> c;
+for (int i = 0; i != 100; ++i)
+c.push_back(copy_tracked(i));
+EXPECT_EQ(0u, copy_tracked::copies);
+c.insert(c.begin() + 50, copy_tracked(-1));
+c.reserve(1000);
+c.resize(1001, copy_tracked(7));
+c.shrink_to_fit();
+EXPECT_EQ(900u, copy_tracked::copies);
+EXPECT_EQ(-1, c[50].value);
+EXPECT_EQ(99, c[100].value);
+
+vector<copy_tracked> const d = c;
+copy_tracked::copies = 0;
+c.push_back(copy_tracked(1));
+EXPECT_EQ(1001u, copy_tracked::copies);
+EXPECT_EQ(1001u, d.size());
+EXPECT_EQ(99, d[100].value);
+}
+
+TEST(correctness, trivially_relocatable_growth
+)
+{
+vector<boxed> c;
+for (int i = 0; i != 100; ++i)
+c.push_back(boxed(i));
+c.insert(c.begin() + 10, c[20]);
+c.resize(200, c[0]);
+c.shrink_to_fit();
+vector<boxed> d = c;
+d.push_back(d[1]);
+d[0] = boxed(-1);
+EXPECT_EQ(200u, c.size());
+EXPECT_EQ(201u, d.size());
+EXPECT_EQ(0, *c[0].value);
+EXPECT_EQ(-1, *d[0].value);
+EXPECT_EQ(20, *c[10].value);
+EXPECT_EQ(99, *c[100].value);
+EXPECT_EQ(0, *c[199].value);
+EXPECT_EQ(1, *d[200].value);
+}
+
+TEST(correctness, trivially_relocatable_faults
+)
+{
+size_t runs = 0, allocations = 0;
+faulty_run([&runs, &allocations]
+{
+++runs;
+allocations = allocations_on_this_thread();
+base_vector<int> c;
+for (int i = 0; i != 100; ++i)
+c.push_back(i);
+c.reserve(300);
+base_vector<int> d = c;
+d.push_back(100);
+allocations = allocations_on_this_thread() - allocations;
+EXPECT_EQ(100u, c.size());
+EXPECT_EQ(101u, d.size());
+EXPECT_EQ(99, d[99]);
+});
+// Growth, reserve and the detach each need a block from operator new, and every one failed once.
+EXPECT_EQ(allocations + 1, runs);
+EXPECT_LE(3u, allocations);
+}
+
+TEST(correctness, emplace_back
+)
+{
+faulty_run([]
+{
+counted::no_new_instances_guard g;
+container c;
+EXPECT_EQ(4, c.emplace_back(4));
+EXPECT_EQ(8, c.emplace_back(8));
+EXPECT_EQ(15, c.emplace_back(15));
+c.emplace_back(c[1]);
+EXPECT_EQ(4u, c.size());
+EXPECT_EQ(4, c[0]);
+EXPECT_EQ(8, c[3]);
+});
+}
+
+TEST(correctness, emplace
+)
+{
+faulty_run([]
+{
+counted::no_new_instances_guard g;
+container c;
+c.emplace(c.begin(), 15);
+c.emplace(c.begin(), 4);
+c.emplace(c.begin() + 1, 8);
+c.emplace(c.end(), 42);
+c.emplace(c.begin() + 3, c[2]);
+EXPECT_EQ(5u, c.size());
+EXPECT_EQ(4, c[0]);
+EXPECT_EQ(8, c[1]);
+EXPECT_EQ(15, c[2]);
+EXPECT_EQ(15, c[3]);
+EXPECT_EQ(42, c[4]);
+});
+}
+
+TEST(correctness, emplace_constructs_in_place
+)
+{
+copy_tracked::copies = 0;
+vector<copy_tracked> c;
+for (int i = 0; i != 20; ++i)
+c.emplace_back(i);
+c.emplace(c.begin() + 5, -1);
+c.emplace(c.begin(), -2);
+EXPECT_EQ(0u, copy_tracked::copies);
+EXPECT_EQ(-2, c[0].value);
+EXPECT_EQ(-1, c[6].value);
+EXPECT_EQ(19, c[21].value);
+
+vector<std::string> s;
+s.emplace_back(3, 'a');
+s.emplace(s.begin(), "b");
+EXPECT_EQ("b", s[0]);
+EXPECT_EQ("aaa", s[1]);
+}
+
+TEST(correctness, small_vector_spill
+)
+{
+faulty_run([]
+{
+counted::no_new_instances_guard g;
+small_container c;
+for (int i = 0; i != 4; ++i)
+c.push_back(i);
+EXPECT_EQ(4u, c.capacity());
+c.push_back(c[0]);
+EXPECT_EQ(5u, c.size());
+EXPECT_LT(4u, c.capacity());
+for (int i = 0; i != 4; ++i)
+EXPECT_EQ(i, c[i]);
+EXPECT_EQ(0, c[4]);
+});
+}
+
+TEST(correctness, small_vector_insert_erase
+)
+{
+faulty_run([]
+{
+counted::no_new_instances_guard g;
+small_container c;
+c.insert(c.begin(), 16);
+c.insert(c.begin(), 4);
+c.insert(c.begin() + 1, 15);
+c.insert(c.begin() + 1, 8);
+c.insert(c.begin() + 4, 42);
+c.insert(c.begin() + 4, 23);
+EXPECT_EQ(6u, c.size());
+EXPECT_EQ(4, c[0]);
+EXPECT_EQ(8, c[1]);
+EXPECT_EQ(15, c[2]);
+EXPECT_EQ(16, c[3]);
+EXPECT_EQ(23, c[4]);
+EXPECT_EQ(42, c[5]);
+
+small_container d;
+d.push_back(1);
+d.push_back(2);
+d.push_back(3);
+d.erase(d.begin());
+EXPECT_EQ(2u, d.size());
+EXPECT_EQ(2, d[0]);
+EXPECT_EQ(3, d[1]);
+});
+}
+
+TEST(correctness, small_vector_resize
+)
+{
+faulty_run([]
+{
+counted::no_new_instances_guard g;
+small_container c;
+c.push_back(1);
+c.resize(3, c[0]);
+EXPECT_EQ(3u, c.size());
+c.resize(10, c[1]);
+EXPECT_EQ(10u, c.size());
+for (size_t i = 0; i != c.size(); ++i)
+EXPECT_EQ(1, c[i]);
+c.resize(2, 5);
+EXPECT_EQ(2u, c.size());
+});
+}
+
+TEST(correctness, small_vector_copy_swap
+)
+{
+faulty_run([]
+{
+counted::no_new_instances_guard g;
+small_container c, d;
+c.push_back(1);
+c.push_back(2);
+for (int i = 0; i != 6; ++i)
+d.push_back(10 + i);
+
+small_container e = c;
+small_container f = d;
+small_container const &cd = d, &cf = f;
+EXPECT_EQ(&cd[0], &cf[0]);
+swap(e, f);
+EXPECT_EQ(6u, e.size());
+EXPECT_EQ(2u, f.size());
+EXPECT_EQ(15, e[5]);
+EXPECT_EQ(2, f[1]);
+e = f;
+EXPECT_TRUE(e == c);
+EXPECT_TRUE(c < d);
+});
+}
+
+TEST(correctness, growth_policy
+)
+{
+faulty_run([]
+{
+counted::no_new_instances_guard g;
+base_vector<counted, plain_counter, one_and_a_half_growth> c;
+std::vector<size_t> capacities;
+for (int i = 0; i != 30; ++i) {
+c.push_back(i);
+if (capacities.empty() || capacities.back() != c.capacity())
+capacities.push_back(c.capacity());
+}
+EXPECT_EQ((std::vector<size_t>{8, 12, 18, 27, 40}), capacities);
+for (int i = 0; i != 30; ++i)
+EXPECT_EQ(i, c[i]);
+});
+}
+
+TEST(correctness, stateless_allocator_is_free
+)
+{
+EXPECT_EQ(sizeof(void *), sizeof(base_vector<int>));
+EXPECT_EQ(sizeof(void *), sizeof(base_vector<counted>));
+}
+
+TEST(correctness, large_elements_are_not_inline
+)
+{
+struct record_256
+{
+    char bytes[256];
+};
+
+EXPECT_EQ(1u, vector_layout<counted>::inline_capacity);
+EXPECT_EQ(0u, vector_layout<cache_line>::inline_capacity);
+EXPECT_EQ(0u, vector_layout<record_256>::inline_capacity);
+EXPECT_EQ(sizeof(void *), vector_layout<record_256>::bytes);
+EXPECT_EQ(sizeof(void *), vector_layout<cache_line>::bytes);
+EXPECT_EQ(4 * sizeof(void *), vector_layout<counted>::bytes);
+// heap_, the cached items_ and size_, and the inline slot.
+EXPECT_EQ(4 * sizeof(void *), vector_layout<int>::bytes);
+
+vector<record_256> c;
+c.push_back(record_256{{'a'}});
+vector<record_256> d = c;
+vector<record_256> const &cc = c, &cd = d;
+EXPECT_EQ(cc.data(), cd.data());
+d[0].bytes[0] = 'b';
+EXPECT_EQ('a', cc[0].bytes[0]);
+EXPECT_EQ('b', cd[0].bytes[0]);
+}
+
+TEST(correctness, over_aligned_inline_elements
+)
+{
+struct alignas(16) wide
+{
+    long long low, high;
+};
+
+// The inline slot starts at the next 16-byte boundary after heap_, items_ and size_.
+size_t const slot = (2 * sizeof(void *) + sizeof(size_t) + 15) / 16 * 16;
+EXPECT_EQ(1u, vector_layout<wide>::inline_capacity);
+EXPECT_EQ(slot + sizeof(wide), vector_layout<wide>::bytes);
+EXPECT_EQ(1u, vector_layout<long double>::inline_capacity);
+EXPECT_EQ(0u, vector_layout<long double>::bytes % alignof(long double));
+
+vector<wide> c;
+c.push_back(wide{1, 2});
+vector<wide> const &cc = c;
+EXPECT_EQ(0u, reinterpret_cast<uintptr_t>(cc.data()) % alignof(wide));
+EXPECT_EQ(2, cc[0].high);
+}
+
+TEST(correctness, allocator_copy_shares_equal_heaps
+)
+{
+faulty_run([]
+{
+counted::no_new_instances_guard g;
+{
+tagged_container c(tagged_allocator<counted>(0));
+c.push_back(1);
+c.push_back(2);
+tagged_container d = c;
+tagged_container const &cc = c, &cd = d;
+EXPECT_EQ(cc.data(), cd.data());
+EXPECT_EQ(1, tagged_allocator<char>::live_blocks[0]);
+}
+EXPECT_EQ(0, tagged_allocator<char>::live_blocks[0]);
+});
+}
+
+TEST(correctness, allocator_assignment_copies_between_heaps
+)
+{
+faulty_run([]
+{
+counted::no_new_instances_guard g;
+{
+tagged_container c(tagged_allocator<counted>(0));
+tagged_container d(tagged_allocator<counted>(1));
+c.push_back(1);
+c.push_back(2);
+d.push_back(3);
+d = c;
+EXPECT_EQ(1, d.get_allocator().tag);
+EXPECT_EQ(1, tagged_allocator<char>::live_blocks[1]);
+tagged_container e(tagged_allocator<counted>(1));
+e = std::move(c);
+EXPECT_EQ(2, tagged_allocator<char>::live_blocks[1]);
+EXPECT_EQ(2u, e.size());
+EXPECT_EQ(2, e[1]);
+EXPECT_EQ(1, d[0]);
+}
+EXPECT_EQ(0, tagged_allocator<char>::live_blocks[0]);
+EXPECT_EQ(0, tagged_allocator<char>::live_blocks[1]);
+});
+}
+
+TEST(correctness, pmr_vector_in_arena
+)
+{
+pmr::request_arena<4096> arena;
+size_t allocations = allocations_on_this_thread();
+pmr::vector<int> c(&arena);
+for (int i = 0; i != 100; ++i)
+c.push_back(i);
+pmr::vector<int> d(&arena);
+d = c;
+pmr::vector<int> const &cc = c, &cd = d;
+EXPECT_EQ(cc.data(), cd.data());
+d.push_back(100);
+EXPECT_EQ(0u, allocations_on_this_thread() - allocations);
+EXPECT_EQ(&arena, d.get_allocator().resource());
+EXPECT_EQ(100u, c.size());
+EXPECT_EQ(101u, d.size());
+EXPECT_EQ(99, d[99]);
+}
+
+TEST(correctness, const_views_do_not_detach
+)
+{
+counted::no_new_instances_guard g;
+container c;
+for (int i = 0; i != 100; ++i)
+c.push_back(i);
+container d = c;
+small_container e;
+for (int i = 0; i != 10; ++i)
+e.push_back(i);
+small_container f = e;
+
+size_t allocations = allocations_on_this_thread();
+int sum = 0;
+for (counted const &item : d.cview())
+sum += item;
+const_span<counted> span = d.as_const_span();
+for (size_t i = 0; i != span.size(); ++i)
+sum += span[i];
+for (counted const &item : f.as_const_span())
+sum += item;
+sum += f.cview()[9] + d.cview().back();
+EXPECT_EQ(0u, allocations_on_this_thread() - allocations);
+EXPECT_EQ(2 * 4950 + 45 + 9 + 99, sum);
+EXPECT_EQ(c.cview().data(), d.cview().data());
+EXPECT_EQ(e.cview().data(), f.as_const_span().data());
+
+d[0] = -1;
+EXPECT_NE(c.cview().data(), d.cview().data());
+EXPECT_EQ(0, c.cview()[0]);
+}
+
+TEST(correctness, cow_vector_reads_do_not_detach
+)
+{
+counted::no_new_instances_guard g;
+cow_vector<counted> c;
+for (int i = 0; i != 100; ++i)
+c.push_back(i);
+cow_vector<counted> d = c;
+
+size_t allocations = allocations_on_this_thread();
+int sum = 0;
+for (size_t i = 0; i != d.size(); ++i)
+sum += d[i].get();
+for (auto it = d.begin(); it != d.end(); ++it)
+sum += (*it).get();
+counted const &last = d.back();
+sum += last;
+EXPECT_EQ(0u, allocations_on_this_thread() - allocations);
+EXPECT_EQ(2 * 4950 + 99, sum);
+EXPECT_EQ(c.data(), d.data());
+}
+
+TEST(correctness, cow_vector_writes_detach
+)
+{
+faulty_run([]
+{
+counted::no_new_instances_guard g;
+cow_vector<counted> c;
+for (int i = 0; i != 10; ++i)
+c.push_back(i);
+cow_vector<counted> d = c;
+d[3] = 42;
+EXPECT_NE(c.data(), d.data());
+EXPECT_EQ(3, c[3].get());
+EXPECT_EQ(42, d[3].get());
+
+cow_vector<counted> e = d;
+auto it = e.begin() + 5;
+*it = e[3];
+EXPECT_EQ(42, e[5].get());
+EXPECT_EQ(5, d[5].get());
+swap(e[0], e[9]);
+EXPECT_EQ(9, e.front().get());
+EXPECT_EQ(0, e.back().get());
+EXPECT_EQ(0, d[0].get());
+std::fill(e.begin() + 1, e.begin() + 3, counted(7));
+EXPECT_EQ(7, e[2].get());
+EXPECT_EQ(2, d[2].get());
+});
+}
+
+TEST(correctness, vector_stats_counters
+)
+{
+vector_stats before = vector_stats::local();
+base_vector<counted> c;
+for (int i = 0; i != 100; ++i)
+c.push_back(i);
+base_vector<counted> d = c;
+base_vector<counted> e = c;
+d[0] = -1;
+e.push_back(100);
+base_vector<counted> f = c;
+f.reserve(1000);
+vector_stats delta = vector_stats::local() - before;
+if (vector_stats::enabled) {
+EXPECT_EQ(4u, delta.reallocations);
+EXPECT_EQ(3u, delta.shared_copy_hits);
+EXPECT_EQ(3u, delta.detaches);
+EXPECT_EQ(300 * sizeof(counted), delta.bytes_copied);
+EXPECT_LE(1000u, delta.peak_capacity);
+} else {
+EXPECT_EQ(0u, delta.reallocations + delta.shared_copy_hits + delta.detaches + delta.bytes_copied);
+EXPECT_EQ(0u, delta.peak_capacity);
+}
+}
+
+TEST(correctness, shared_mutations_copy_only_survivors
+)
+{
+faulty_run([]
+{
+counted::no_new_instances_guard g;
+base_vector<counted_copies> c;
+for (int i = 0; i != 10; ++i)
+c.push_back(i);
+
+base_vector<counted_copies> d = c;
+counted_copies::copies = 0;
+d.pop_back();
+EXPECT_EQ(9u, counted_copies::copies);
+
+d = c;
+counted_copies::copies = 0;
+d.erase(d.cbegin() + 6, d.cend());
+EXPECT_EQ(6u, counted_copies::copies);
+
+d = c;
+counted_copies::copies = 0;
+d.erase(d.cbegin() + 2, d.cbegin() + 5);
+EXPECT_EQ(7u, counted_copies::copies);
+
+d = c;
+counted_copies::copies = 0;
+d.resize(4, counted_copies(0));
+EXPECT_EQ(4u, counted_copies::copies);
+
+vector<counted_copies> e(c.cbegin(), c.cend());
+vector<counted_copies> f = e;
+counted_copies::copies = 0;
+f.pop_back();
+EXPECT_EQ(9u, counted_copies::copies);
+f.pop_back();
+EXPECT_EQ(9u, counted_copies::copies);
+
+EXPECT_EQ(10u, c.size());
+EXPECT_EQ(9, c.cview().back());
+EXPECT_EQ(10u, e.size());
+EXPECT_EQ(8u, f.size());
+EXPECT_EQ(7, f.cview().back());
+});
+}
+
+TEST(correctness, vector_slice_fan_out
+)
+{
+counted::no_new_instances_guard g;
+vector<counted> c;
+for (int i = 0; i != 1000; ++i)
+c.push_back(i);
+
+std::vector<vector_slice<counted>> batches;
+batches.reserve(10);
+size_t allocations = allocations_on_this_thread();
+for (size_t i = 0; i != 10; ++i)
+batches.push_back(c.slice(i * 100, 100));
+vector_slice<counted> inner = batches[3].slice(10, 20);
+inner.remove_prefix(5);
+inner.remove_suffix(5);
+EXPECT_EQ(0u, allocations_on_this_thread() - allocations);
+EXPECT_EQ(10u, inner.size());
+EXPECT_EQ(315, inner.cview().front());
+EXPECT_EQ(324, inner.cview().back());
+EXPECT_EQ(c.cview().data() + 315, inner.cview().data());
+EXPECT_TRUE(batches[3].slice(15, 10) == inner);
+EXPECT_TRUE(batches[2] < batches[3]);
+}
+
+TEST(correctness, vector_slice_copies_window_on_write
+)
+{
+faulty_run([]
+{
+counted::no_new_instances_guard g;
+base_vector<counted_copies> c;
+for (int i = 0; i != 100; ++i)
+c.push_back(i);
+vector_slice<counted_copies> s = c.slice(40, 10);
+counted_copies::copies = 0;
+s[0] = counted_copies(-1);
+EXPECT_EQ(10u, counted_copies::copies);
+EXPECT_EQ(-1, s.cview()[0]);
+EXPECT_EQ(40, c.cview()[40]);
+EXPECT_EQ(10u, s.to_vector().size());
+
+vector_slice<counted_copies> t = c.slice(10, 5);
+c = base_vector<counted_copies>();
+counted_copies::copies = 0;
+t.back() = counted_copies(-2);
+EXPECT_EQ(0u, counted_copies::copies);
+EXPECT_EQ(-2, t.cview()[4]);
+EXPECT_EQ(10, t.cview()[0]);
+});
+}
+
+TEST(correctness, persistent_vector_push_pop
+)
+{
+counted::no_new_instances_guard g;
+persistent_vector<counted> c;
+for (int i = 0; i != 1000; ++i)
+c.push_back(i);
+faulty_run([&c]
+{
+counted::no_new_instances_guard g;
+persistent_vector<counted> d = c;
+for (int i = 1000; i != 1060; ++i)
+d.push_back(i);
+for (int i = 0; i != 60; ++i)
+d.pop_back();
+d.pop_back();
+EXPECT_EQ(1000u, c.size());
+EXPECT_EQ(999u, d.size());
+persistent_vector<counted> const &cc = c, &cd = d;
+EXPECT_EQ(998, cd.back());
+EXPECT_EQ(999, cc.back());
+EXPECT_TRUE(cd < cc);
+d.push_back(999);
+EXPECT_TRUE(c == d);
+});
+}
+
+TEST(correctness, persistent_vector_write_copies_path
+)
+{
+counted::no_new_instances_guard g;
+persistent_vector<counted_copies> c;
+for (int i = 0; i != 40000; ++i)
+c.push_back(i);
+persistent_vector<counted_copies> d = c;
+counted_copies::copies = 0;
+d[12345] = counted_copies(-1);
+EXPECT_EQ(32u, counted_copies::copies);
+d[12346] = counted_copies(-2);
+d.back() = counted_copies(-3);
+EXPECT_EQ(64u, counted_copies::copies);
+
+persistent_vector<counted_copies> const &cc = c, &cd = d;
+EXPECT_EQ(12345, cc[12345]);
+EXPECT_EQ(-1, cd[12345]);
+EXPECT_EQ(-2, cd[12346]);
+EXPECT_EQ(-3, cd.back());
+EXPECT_EQ(39999, cc.back());
+EXPECT_TRUE(c != d);
+int expected = 0;
+for (auto it = cc.begin(); it != cc.end(); ++it)
+EXPECT_EQ(expected++, *it);
+EXPECT_EQ(40000, expected);
+EXPECT_EQ(39999, *cc.rbegin());
+
+swap(c, d);
+EXPECT_EQ(-1, cc[12345]);
+EXPECT_EQ(12345, cd[12345]);
+}
+
+TEST(correctness, bulk_insert
+)
+{
+faulty_run([]
+{
+counted::no_new_instances_guard g;
+base_vector<counted_copies> c;
+for (int i = 0; i != 10; ++i)
+c.push_back(i);
+
+base_vector<counted_copies> d(c.cbegin(), c.cend());
+counted_copies::copies = 0;
+d.insert(d.cbegin() + 3, c.cbegin(), c.cbegin() + 5);
+EXPECT_EQ(15u, counted_copies::copies);
+EXPECT_EQ(15u, d.size());
+EXPECT_EQ(2, d[2]);
+EXPECT_EQ(0, d[3]);
+EXPECT_EQ(4, d[7]);
+EXPECT_EQ(3, d[8]);
+EXPECT_EQ(9, d[14]);
+
+d.insert(d.cbegin() + 1, d.cbegin(), d.cend());
+EXPECT_EQ(30u, d.size());
+EXPECT_EQ(0, d[0]);
+EXPECT_EQ(0, d[1]);
+EXPECT_EQ(2, d[3]);
+EXPECT_EQ(9, d[15]);
+EXPECT_EQ(1, d[16]);
+EXPECT_EQ(9, d[29]);
+
+d.reserve(40);
+d.insert(d.cend(), 3, d[16]);
+d.append_range(c);
+EXPECT_EQ(43u, d.size());
+EXPECT_EQ(1, d[32]);
+EXPECT_EQ(0, d[33]);
+EXPECT_EQ(9, d[42]);
+EXPECT_EQ(10u, c.size());
+
+small_container s;
+s.push_back(1);
+s.push_back(2);
+s.push_back(3);
+s.insert(s.cbegin() + 1, s.cbegin(), s.cend());
+EXPECT_EQ(6u, s.size());
+EXPECT_EQ(1, s[0]);
+EXPECT_EQ(1, s[1]);
+EXPECT_EQ(3, s[3]);
+EXPECT_EQ(2, s[4]);
+
+small_container t;
+t.push_back(5);
+t.insert(t.cbegin(), 2, t[0]);
+t.append_range(s);
+EXPECT_EQ(9u, t.size());
+EXPECT_EQ(5, t[2]);
+EXPECT_EQ(1, t[3]);
+EXPECT_EQ(3, t[8]);
+});
+}
+
+TEST(correctness, bulk_insert_allocates_once
+)
+{
+base_vector<copy_tracked> c;
+for (int i = 0; i != 10; ++i)
+c.push_back(i);
+base_vector<copy_tracked> d(c.cbegin(), c.cend());
+copy_tracked::copies = 0;
+size_t allocations = allocations_on_this_thread();
+d.insert(d.cbegin() + 5, c.cbegin(), c.cend());
+EXPECT_EQ(1u, allocations_on_this_thread() - allocations);
+EXPECT_EQ(10u, copy_tracked::copies);
+EXPECT_EQ(20u, d.size());
+EXPECT_EQ(4, d[4].value);
+EXPECT_EQ(0, d[5].value);
+EXPECT_EQ(5, d[15].value);
+
+container_int e;
+e.insert(e.cend(), 3, 7);
+std::istringstream in("1 2 3");
+e.insert(e.cbegin() + 1, std::istream_iterator<int>(in), std::istream_iterator<int>());
+EXPECT_EQ(6u, e.size());
+EXPECT_EQ(7, e[0]);
+EXPECT_EQ(1, e[1]);
+EXPECT_EQ(3, e[3]);
+EXPECT_EQ(7, e[5]);
+}
+
+TEST(correctness, construct_from_iterator_categories
+)
+{
+faulty_run([]
+{
+counted::no_new_instances_guard g;
+std::istringstream in("4 8 15 16 23 42");
+container c{std::istream_iterator<int>(in), std::istream_iterator<int>()};
+EXPECT_EQ(6u, c.size());
+EXPECT_EQ(4, c[0]);
+EXPECT_EQ(42, c[5]);
+
+std::istringstream small_in("1 2");
+small_container d{std::istream_iterator<int>(small_in), std::istream_iterator<int>()};
+EXPECT_EQ(2u, d.size());
+EXPECT_EQ(2, d[1]);
+
+std::list<counted> items(c.cbegin(), c.cend());
+base_vector<counted> e(items.begin(), items.end());
+EXPECT_EQ(6u, e.size());
+EXPECT_EQ(6u, e.capacity());
+EXPECT_EQ(23, e[4]);
+});
+
+int const raw[] = {3, 1, 4, 1, 5};
+base_vector<int> f(raw, raw + 5);
+EXPECT_EQ(5u, f.capacity());
+EXPECT_EQ(4, f[2]);
+EXPECT_EQ(5, f[4]);
+
+base_vector<int> g(3, 5);
+container_int h(3, 5);
+small_vector<int, 2> i(3, 5);
+EXPECT_EQ(3u, g.size());
+EXPECT_EQ(5, g[2]);
+EXPECT_EQ(3u, h.size());
+EXPECT_EQ(5, h[2]);
+EXPECT_EQ(3u, i.size());
+EXPECT_EQ(5, i[2]);
+}
+
+TEST(correctness, append_uninitialized
+)
+{
+base_vector<char> c(3, 'a');
+base_vector<char> d = c;
+span<char> tail = d.append_uninitialized(5);
+EXPECT_EQ(5u, tail.size());
+std::fill(tail.begin(), tail.end(), 'b');
+EXPECT_EQ(8u, d.size());
+EXPECT_EQ('a', d[2]);
+EXPECT_EQ('b', d[7]);
+EXPECT_EQ(3u, c.size());
+
+d.resize_default_init(1000);
+EXPECT_EQ(1000u, d.size());
+EXPECT_EQ('b', d[7]);
+d.resize_default_init(2);
+EXPECT_EQ(2u, d.size());
+EXPECT_EQ('a', d[1]);
+
+small_vector<int, 4> e;
+e.push_back(1);
+span<int> inline_tail = e.append_uninitialized(2);
+inline_tail[0] = 2;
+inline_tail[1] = 3;
+span<int> heap_tail = e.append_uninitialized(3);
+std::fill(heap_tail.begin(), heap_tail.end(), 4);
+EXPECT_EQ(6u, e.size());
+EXPECT_EQ(3, e[2]);
+EXPECT_EQ(4, e[5]);
+
+vector<std::string> f;
+f.resize_default_init(3);
+EXPECT_EQ(3u, f.size());
+EXPECT_TRUE(f[2].empty());
+}
+
+namespace
+{
+// Checks == and < against the standard algorithms with the first difference at every position.
+template <typename T>
+void expect_standard_comparison(T low, T high)
+{
+for (size_t n = 0; n != 70; ++n)
+{
+base_vector<T> a(n, low);
+for (size_t i = 0; i <= n; ++i)
+{
+base_vector<T> b = a;
+if (i != n)
+b[i] = high;
+else
+b.push_back(high);
+EXPECT_EQ(std::equal(a.cbegin(), a.cend(), b.cbegin(), b.cend()), a == b);
+EXPECT_EQ(std::lexicographical_compare(a.cbegin(), a.cend(), b.cbegin(), b.cend()), a < b);
+EXPECT_EQ(std::lexicographical_compare(b.cbegin(), b.cend(), a.cbegin(), a.cend()), b < a);
+}
+}
+}
+}
+
+TEST(correctness, simd_comparison
+)
+{
+expect_standard_comparison<int>(-1, 1);
+expect_standard_comparison<long long>(5, -(1ll << 40));
+expect_standard_comparison<unsigned char>(1, 200);
+expect_standard_comparison<char>(1, -100);
+expect_standard_comparison<float>(0.5f, -0.5f);
+expect_standard_comparison<double>(1.0, 2.0);
+
+float const nan = std::numeric_limits<float>::quiet_NaN();
+base_vector<float> c(20, nan);
+base_vector<float> d(20, nan);
+EXPECT_FALSE(c == d);
+d[19] = 1.0f;
+c[19] = 0.0f;
+EXPECT_TRUE(c < d);
+EXPECT_FALSE(d < c);
+
+base_vector<double> zeros(9, 0.0);
+base_vector<double> negative_zeros(9, -0.0);
+EXPECT_TRUE(zeros == negative_zeros);
+EXPECT_FALSE(zeros < negative_zeros);
+}
+
+TEST(correctness, hash_matches_equality
+)
+{
+std::unordered_set<vector<int>> keys;
+vector<int> a;
+for (int i = 0; i != 100; ++i)
+{
+a.push_back(i);
+keys.insert(a);
+}
+EXPECT_EQ(100u, keys.size());
+vector<int> b(a.cbegin(), a.cbegin() + 3);
+EXPECT_EQ(1u, keys.count(b));
+EXPECT_EQ(std::hash<vector<int>>()(b), std::hash<base_vector<int>>()(base_vector<int>(b.cbegin(), b.cend())));
+EXPECT_EQ(b.hash(), a.slice(0, 3).hash());
+
+base_vector<double> zeros(5, 0.0);
+base_vector<double> negative_zeros(5, -0.0);
+EXPECT_EQ(zeros.hash(), negative_zeros.hash());
+}
+
+TEST(correctness, shared_hash_is_cached
+)
+{
+typedef base_vector<hash_tracked, hash_caching<plain_counter>> hashed_container;
+hashed_container a;
+for (int i = 0; i != 10; ++i)
+a.push_back(i);
+hashed_container b = a;
+
+hash_tracked::hashes = 0;
+size_t hash = std::hash<hashed_container>()(a);
+EXPECT_EQ(10u, hash_tracked::hashes);
+EXPECT_EQ(hash, std::hash<hashed_container>()(b));
+EXPECT_EQ(10u, hash_tracked::hashes);
+
+b[0] = 42;
+EXPECT_NE(hash, b.hash());
+EXPECT_EQ(20u, hash_tracked::hashes);
+EXPECT_EQ(hash, a.hash());
+EXPECT_EQ(30u, hash_tracked::hashes);
+
+a[0] = 42;
+hashed_container c = a;
+EXPECT_EQ(b.hash(), c.hash());
+EXPECT_EQ(b.hash(), a.hash());
+}
+
+TEST(correctness, equality_short_circuits
+)
+{
+typedef base_vector<hash_tracked, hash_caching<plain_counter>> hashed_container;
+hashed_container a;
+hashed_container b;
+for (int i = 0; i != 10; ++i)
+{
+a.push_back(i);
+b.push_back(i == 9 ? -1 : i);
+}
+hashed_container a_copy = a;
+hashed_container b_copy = b;
+
+hash_tracked::compares = 0;
+EXPECT_FALSE(a == b);
+EXPECT_EQ(10u, hash_tracked::compares);
+a.hash();
+b.hash();
+EXPECT_FALSE(a == b);
+EXPECT_TRUE(a == a_copy);
+EXPECT_EQ(10u, hash_tracked::compares);
+a_copy.pop_back();
+EXPECT_FALSE(a == a_copy);
+EXPECT_EQ(10u, hash_tracked::compares);
+
+vector<hash_tracked> c(a.cview().cbegin(), a.cview().cend());
+vector<hash_tracked> d = c;
+EXPECT_TRUE(c == d);
+small_vector<hash_tracked, 16> e(a.cview().cbegin(), a.cview().cend());
+small_vector<hash_tracked, 16> f(b.cview().cbegin(), b.cview().cend());
+EXPECT_TRUE(e == e);
+EXPECT_EQ(10u, hash_tracked::compares);
+EXPECT_FALSE(e == f);
+EXPECT_EQ(20u, hash_tracked::compares);
+}
+
+TEST(correctness, parallel_bulk_copies
+)
+{
+parallel_threshold_guard guard(1024);
+base_vector<parallel_int> a;
+for (int i = 0; i != 100000; ++i)
+a.push_back(parallel_int{i});
+base_vector<parallel_int> b(a.cbegin(), a.cend());
+base_vector<parallel_int> c = b;
+c[0].value = -1;
+c.resize(200000, parallel_int{7});
+EXPECT_TRUE(a == b);
+EXPECT_EQ(99999, c[99999].value);
+EXPECT_EQ(7, c[199999].value);
+EXPECT_EQ(0, b[0].value);
+
+faulty_run([]
+{
+base_vector<parallel_tracked> d;
+d.reserve(1000);
+for (int i = 0; i != 1000; ++i)
+d.emplace_back(i);
+base_vector<parallel_tracked> e = d;
+e.resize(2000, parallel_tracked(1));
+e.insert(e.cbegin() + 10, d.cbegin(), d.cend());
+EXPECT_EQ(3000u, e.size());
+EXPECT_EQ(999, e.cview()[1009].value);
+EXPECT_EQ(10, e.cview()[1010].value);
+EXPECT_EQ(1, e.cview()[2999].value);
+});
+EXPECT_EQ(0, parallel_tracked::instances);
+}
+
+TEST(correctness, parallel_copies_are_opt_in
+)
+{
+static_assert(!is_parallel_copyable_v<int>);
+static_assert(!is_parallel_copyable_v<thread_tracked<false>>);
+parallel_threshold_guard guard(1024);
+thread_tracked<false>::test_thread = thread_tracked<true>::test_thread = std::this_thread::get_id();
+thread_tracked<false>::foreign_copies = thread_tracked<true>::foreign_copies = 0;
+
+base_vector<thread_tracked<false>> a(100000, thread_tracked<false>(1));
+base_vector<thread_tracked<false>> b = a;
+b[0].value = 2;
+b.insert(b.cbegin(), a.cbegin(), a.cend());
+EXPECT_EQ(0, thread_tracked<false>::foreign_copies);
+
+// The pool always has a worker, so an opted-in type does get copied off this thread.
+base_vector<thread_tracked<true>> c(100000, thread_tracked<true>(1));
+base_vector<thread_tracked<true>> d = c;
+d[0].value = 2;
+EXPECT_LT(0, thread_tracked<true>::foreign_copies);
+EXPECT_EQ(1, c[0].value);
+}
+
+TEST(correctness, compact_header
+)
+{
+faulty_run([]
+{
+counted::no_new_instances_guard g;
+base_vector<counted, compact_counter> c;
+for (int i = 0; i != 100; ++i)
+c.push_back(i);
+base_vector<counted, compact_counter> d = c;
+base_vector<counted, compact_counter> const &cc = c, &cd = d;
+EXPECT_EQ(cc.data(), cd.data());
+d.push_back(100);
+EXPECT_NE(cc.data(), cd.data());
+EXPECT_EQ(100u, c.size());
+EXPECT_EQ(101u, d.size());
+for (int i = 0; i != 100; ++i)
+EXPECT_EQ(i, cd[i]);
+});
+}
+
+TEST(correctness, over_aligned_elements
+)
+{
+auto aligned = [](cache_line const *p)
+{ return reinterpret_cast<uintptr_t>(p) % alignof(cache_line) == 0; };
+base_vector<cache_line> c;
+base_vector<cache_line, compact_counter> d;
+small_vector<cache_line, 2> e;
+for (int i = 0; i != 20; ++i) {
+c.push_back(i);
+d.push_back(i);
+e.push_back(i);
+EXPECT_TRUE(aligned(c.cbegin()));
+EXPECT_TRUE(aligned(d.cbegin()));
+EXPECT_TRUE(aligned(e.cbegin()));
+}
+EXPECT_EQ(19, c[19].value);
+EXPECT_EQ(19, d[19].value);
+EXPECT_EQ(19, e[19].value);
+}
+
 
 TEST(exceptions, nothrow_default_ctor
 )
@@ -1714,6 +3029,74 @@ c.push_back(42);
 }
 
 
+TEST(exceptions, compact_header_overflow
+)
+{
+base_vector<char, compact_counter> c(3, 'x');
+EXPECT_THROW(c.reserve(size_t(std::numeric_limits<uint32_t>::max()) + 1), std::length_error);
+EXPECT_EQ(3u, c.capacity());
+EXPECT_EQ('x', c[2]);
+}
+
+TEST(correctness, full_counter_copies_elements
+)
+{
+compact_counter counter(std::numeric_limits<uint32_t>::max() - 1);
+EXPECT_TRUE(counter.acquire());
+EXPECT_FALSE(counter.acquire());
+EXPECT_FALSE(counter.release());
+EXPECT_TRUE(counter.acquire());
+compact_atomic_counter atomic(std::numeric_limits<uint32_t>::max());
+EXPECT_FALSE(atomic.acquire());
+EXPECT_FALSE(atomic.release());
+EXPECT_TRUE(atomic.acquire());
+
+typedef base_vector<char, basic_plain_counter<uint8_t>> tiny_vector;
+tiny_vector c(3, 'x');
+std::vector<tiny_vector> copies(300, c);
+tiny_vector const &cc = c;
+EXPECT_EQ(cc.data(), static_cast<tiny_vector const &>(copies[253]).data());
+EXPECT_NE(cc.data(), static_cast<tiny_vector const &>(copies[254]).data());
+for (tiny_vector const &copy : copies)
+EXPECT_EQ(c, copy);
+copies.clear();
+c.push_back('y');
+EXPECT_EQ(cc.data(), tiny_vector(c).cview().data());
+}
+
+TEST(exceptions, bulk_insert_strong_guarantee
+)
+{
+faulty_run([]
+{
+counted::no_new_instances_guard g;
+container c;
+for (int i = 0; i != 5; ++i)
+c.push_back(i);
+container d;
+for (int i = 0; i != 10; ++i)
+d.push_back(i + 100);
+
+try
+{
+c.insert(c.cbegin() + 2, d.cbegin(), d.cend());
+}
+catch (...)
+{
+fault_injection_disable dg;
+EXPECT_EQ(5u, c.size());
+for (int i = 0; i != 5; ++i)
+EXPECT_EQ(i, c[i]);
+throw;
+}
+EXPECT_EQ(15u, c.size());
+EXPECT_EQ(1, c[1]);
+EXPECT_EQ(100, c[2]);
+EXPECT_EQ(109, c[11]);
+EXPECT_EQ(2, c[12]);
+});
+}
+
 TEST(speed, push_1000000_my
 )
 {
@@ -1758,7 +3141,44 @@ size()
 });
 }
 
+TEST(speed, push_100000000_my
+)
+{
+faulty_run([]
+{
+vector<int> c;
+for(
+size_t i = 0;
+i<100000000; i++) {
+c.
+push_back(i
+*2+1);
+}
+EXPECT_EQ(100000000u, c.
+
+size()
 
+);
+});
+}
 
+TEST(speed, push_100000000_stl
+)
+{
+faulty_run([]
+{
+std::vector<int> c;
+for(
+size_t i = 0;
+i<100000000; i++) {
+c.
+push_back(i
+*2+1);
+}
+EXPECT_EQ(100000000u, c.
 
+size()
 
+);
+});
+}